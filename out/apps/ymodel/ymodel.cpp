@@ -30,6 +30,7 @@
 #include <yocto/yocto_scene.h>
 #include <yocto/yocto_sceneio.h>
 #include <yocto_model/yocto_model.h>
+#include <yocto_model/yocto_noisegraph.h>
 using namespace yocto;
 
 #include <filesystem>
@@ -46,6 +47,10 @@ void run(const vector<string>& args) {
   // command line parameters
   auto terrain            = ""s;
   auto tparams            = terrain_params{};
+  auto terrain_tiles      = ""s;
+  auto ttparams           = terrain_tile_params{};
+  auto terrain_lod        = false;
+  auto lparams            = terrain_lod_params{};
   auto displacement       = ""s;
   auto dparams            = displacement_params{};
   auto hair               = ""s;
@@ -63,17 +68,34 @@ void run(const vector<string>& args) {
   auto smooth_vor         = false;
   auto voronoise_u        = -1.0f;
   auto voronoise_v        = -1.0f;
+  auto noisegraph         = ""s;
+  auto voronoise_check    = false;
+  auto analytic_normals   = false;
+  auto adaptive_tolerance = 0.0f;
+  auto adaptive_levels    = 4;
+  auto noise_cache        = ""s;
   auto influence_radius   = 0.005f;
   auto cell_size          = 0.005f;
   auto tree               = false;
   auto tree_2             = false;
   auto trparams           = tree_params{};
   auto woods              = 0;
+  auto forest             = 0;
+  auto fparams            = forest_params{};
 
   // parse command line
   auto error = string{};
   auto cli   = make_cli("ymodel", "Make procedural scenes");
   add_option(cli, "terrain", terrain, "terrain object");
+  add_option(cli, "terrain_tiles", terrain_tiles, "tiled terrain directory");
+  add_option(cli, "tiles", ttparams.tiles, "number of terrain tiles");
+  add_option(cli, "tile_steps", ttparams.tile_steps, "terrain tile steps");
+  add_option(cli, "tile_size", ttparams.tile_size, "terrain tile size");
+  add_option(cli, "tile_in_flight", ttparams.in_flight,
+      "max terrain tiles in memory");
+  add_option(cli, "terrain_lod", terrain_lod, "add terrain tiles with lods");
+  add_option(cli, "lod_levels", lparams.levels, "terrain levels of detail");
+  add_option(cli, "lod_distance", lparams.distance, "terrain lod distance");
   add_option(cli, "displacement", displacement, "displacement object");
   add_option(cli, "hair", hair, "hair object");
   add_option(cli, "hairbase", hairbase, "hairbase object");
@@ -84,6 +106,13 @@ void run(const vector<string>& args) {
   add_option(cli, "hairstr", hparams.strength, "hair strength");
   add_option(cli, "hairgrav", hparams.gravity, "hair gravity");
   add_option(cli, "hairstep", hparams.steps, "hair steps");
+  add_option(cli, "haircurves", hparams.curves, "hair bezier curves");
+  add_option(cli, "haircollision", hparams.collision_offset,
+      "hair distance from the base shape");
+  add_option(cli, "hairseparation", hparams.collision_radius,
+      "hair distance between strands");
+  add_option(cli, "hairguides", hparams.guides, "hair guide strands");
+  add_option(cli, "hairclumping", hparams.clumping, "hair clumping");
   add_option(cli, "output", output, "output scene");
   add_option(cli, "scene", filename, "input scene");
   add_option(cli, "dense_hair", dense_hair, "dense_hair choice");
@@ -92,11 +121,23 @@ void run(const vector<string>& args) {
   add_option(cli, "smooth_vor", smooth_vor, "smooth voronoise choice");
   add_option(cli, "voronoise_u", voronoise_u, "voronoise_v value");
   add_option(cli, "voronoise_v", voronoise_v, "voronoise_u value");
+  add_option(cli, "noisegraph", noisegraph, "noise graph for displacement");
+  add_option(cli, "voronoise_check", voronoise_check,
+      "check fast voronoise against its reference");
+  add_option(cli, "analytic_normals", analytic_normals,
+      "displaced normals from noise gradients");
+  add_option(cli, "adaptive_tolerance", adaptive_tolerance,
+      "displacement error that splits an edge");
+  add_option(cli, "adaptive_levels", adaptive_levels,
+      "max adaptive subdivision levels");
+  add_option(cli, "noise_cache", noise_cache, "noise cache directory");
   add_option(cli, "sample_elimination", sample_elimination,
       "sample_elimination for hair");
   add_option(cli, "influence_radius", influence_radius,
       "influence_radius for sample elimination");
   add_option(cli, "cell_size", cell_size, "cell_size for sample elimination");
+  add_option(cli, "progressive", hparams.progressive,
+      "order hair strands by progressive sample elimination");
   add_option(cli, "tree", tree, "tree");
   add_option(cli, "tree_2", tree_2, "tree_2");
   add_option(cli, "brsteps", trparams.steps, "number of steps");
@@ -128,9 +169,32 @@ void run(const vector<string>& args) {
       cli, "gravity", trparams.gravity, "Gravity that influences the tree");
   add_option(cli, "show_crown_points", trparams.show_crown_points,
       "Show the attraction points");
+  add_option(cli, "tree_segments", trparams.segments,
+      "Draw trees as instanced segments");
   add_option(cli, "woods", woods, "make woods");
+  add_option(cli, "forest", forest, "make forest of instanced trees");
+  add_option(
+      cli, "forest_variants", fparams.variants, "tree variants of forests");
   if (!parse_cli(cli, args, error)) print_fatal(error);
 
+  // check forest parameters
+  if (forest < 0) print_fatal("forest must be non-negative");
+  if (fparams.variants < 1) print_fatal("forest_variants must be positive");
+
+  // check fast noise against its reference
+  if (voronoise_check) {
+    if (!check_voronoise(100000, error)) print_fatal(error);
+    print_info("fast voronoise within tolerance");
+    return;
+  }
+
+  // tiled terrains are saved directly
+  if (terrain_tiles != "") {
+    if (!make_terrain_tiles(terrain_tiles, tparams, ttparams, error))
+      print_fatal(error);
+    return;
+  }
+
   // load scene
   auto scene = scene_data{};
   if (!load_scene(filename, scene, error)) print_fatal(error);
@@ -139,9 +203,32 @@ void run(const vector<string>& args) {
   if (influence_radius != 0.005) hparams.influence_radius = influence_radius;
 
   if (cell_size != 0.005) hparams.cell_size = cell_size;
+
+  // set normals computation
+  tparams.analytic_normals = analytic_normals;
+  dparams.analytic_normals = analytic_normals;
+
+  // set adaptive tessellation
+  tparams.adaptive_tolerance = adaptive_tolerance;
+  tparams.adaptive_levels    = adaptive_levels;
+  dparams.adaptive_tolerance = adaptive_tolerance;
+  dparams.adaptive_levels    = adaptive_levels;
+
+  // set noise cache
+  tparams.cache = noise_cache;
+  dparams.cache = noise_cache;
+
+  // curved hair is tesselated when the scene is loaded
+  auto hair_name = hparams.curves > 0 ? "hair_bezier"s : "hair"s;
+
   // create procedural geometry
   if (woods) {
-    make_woods(scene, get_instance(scene, grassbase), woods);
+    make_woods(
+        scene, get_instance(scene, grassbase), woods, trparams.segments);
+  }
+  if (forest) {
+    fparams.num = forest;
+    make_forest(scene, get_instance(scene, grassbase), fparams);
   }
   if (tree) {
     generate_tree(scene, {0, 0, 0},
@@ -161,13 +248,25 @@ void run(const vector<string>& args) {
         },
         trparams, 1234);
   }
+  if (terrain_lod) {
+    auto camera = scene.cameras.empty() ? zero3f
+                                        : scene.cameras.front().frame.o;
+    add_terrain_lods(
+        scene, make_terrain_lods(tparams, ttparams, lparams), camera, lparams);
+  }
   if (terrain != "") {
     make_terrain(scene.shapes[get_instance(scene, terrain).shape], tparams);
   }
   if (displacement != "") {
     std::cout << world << cell << smooth_vor << voronoise_u << voronoise_v
               << std::endl;
-    if (world) {
+    if (noisegraph != "") {
+      auto graph = noise_graph{};
+      if (!load_noise_graph(noisegraph, graph, error)) print_fatal(error);
+      make_noise_displacement(
+          scene.shapes[get_instance(scene, displacement).shape], graph,
+          dparams);
+    } else if (world) {
       make_world(
           scene.shapes[get_instance(scene, displacement).shape], dparams);
     } else if (cell) {
@@ -187,7 +286,7 @@ void run(const vector<string>& args) {
   }
   if (hair != "" && !dense_hair) {
     scene.shapes[get_instance(scene, hair).shape]      = {};
-    scene.shape_names[get_instance(scene, hair).shape] = "hair";
+    scene.shape_names[get_instance(scene, hair).shape] = hair_name;
     if (sample_elimination) {
       make_hair_sample_elimination(
           scene.shapes[get_instance(scene, hair).shape],
@@ -207,7 +306,7 @@ void run(const vector<string>& args) {
   }
   if (hair != "" && dense_hair) {
     scene.shapes[get_instance(scene, hair).shape]      = {};
-    scene.shape_names[get_instance(scene, hair).shape] = "hair";
+    scene.shape_names[get_instance(scene, hair).shape] = hair_name;
     make_dense_hair(scene, scene.shapes[get_instance(scene, hair).shape],
         get_instance(scene, hairbase), hparams);
   }
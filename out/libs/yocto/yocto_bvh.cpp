@@ -1112,6 +1112,13 @@ bvh_intersection intersect_bvh(const bvh_data& bvh, const scene_data& scene,
   return intersection;
 }
 
+bvh_intersection overlap_bvh(const bvh_data& bvh, const shape_data& shape,
+    const vec3f& pos, float max_distance, bool find_any) {
+  auto intersection = bvh_intersection{};
+  intersection.hit  = overlap_bvh(bvh, shape, pos, max_distance,
+      intersection.element, intersection.uv, intersection.distance, find_any);
+  return intersection;
+}
 bvh_intersection overlap_bvh(const bvh_data& bvh, const scene_data& scene,
     const vec3f& pos, float max_distance, bool find_any,
     bool non_rigid_frames) {
@@ -161,6 +161,19 @@ inline int sample_discrete(const vector<float>& cdf, float r);
 // Pdf for uniform discrete distribution sampling.
 inline float sample_discrete_pdf(const vector<float>& cdf, int idx);
 
+// Alias table of a discrete distribution, for constant time sampling.
+struct alias_table {
+  vector<float> probs   = {};
+  vector<int>   aliases = {};
+};
+
+// Make an alias table from non-negative weights.
+inline alias_table make_alias_table(const vector<float>& weights);
+// Sample an alias table from a uniform index in [0, size) and a uniform
+// number in [0, 1). The index is given as integer to reach all elements of
+// large tables.
+inline int sample_alias(const alias_table& table, int idx, float r);
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
@@ -394,6 +407,44 @@ inline float sample_discrete_pdf(const vector<float>& cdf, int idx) {
   return cdf.at(idx) - cdf.at(idx - 1);
 }
 
+// Make an alias table from non-negative weights [Vose 1991].
+inline alias_table make_alias_table(const vector<float>& weights) {
+  auto size  = (int)weights.size();
+  auto table = alias_table{};
+  table.probs.assign(size, 1);
+  table.aliases.resize(size);
+  for (auto idx = 0; idx < size; idx++) table.aliases[idx] = idx;
+  auto sum = 0.0;
+  for (auto weight : weights) sum += weight;
+  if (sum <= 0) return table;
+
+  // split elements in under and over full, pairing each under full element
+  // with an over full one
+  auto scaled = vector<double>(size);
+  auto small = vector<int>{}, large = vector<int>{};
+  for (auto idx = 0; idx < size; idx++) {
+    scaled[idx] = weights[idx] * size / sum;
+    (scaled[idx] < 1 ? small : large).push_back(idx);
+  }
+  while (!small.empty() && !large.empty()) {
+    auto under = small.back(), over = large.back();
+    small.pop_back();
+    table.probs[under]   = (float)scaled[under];
+    table.aliases[under] = over;
+    scaled[over] -= 1 - scaled[under];
+    if (scaled[over] < 1) {
+      large.pop_back();
+      small.push_back(over);
+    }
+  }
+  return table;
+}
+
+// Sample an alias table.
+inline int sample_alias(const alias_table& table, int idx, float r) {
+  return r < table.probs[idx] ? idx : table.aliases[idx];
+}
+
 }  // namespace yocto
 
 #endif
@@ -1989,6 +1989,19 @@ static void add_missing_radius(scene_data& scene, float radius = 0.001f) {
   }
 }
 
+// Tesselate Bezier curve shapes, marked by a name ending in `_bezier`.
+static void tesselate_bezier_shapes(scene_data& scene) {
+  auto suffix = string{"_bezier"};
+  for (auto idx : range(scene.shape_names.size())) {
+    auto& name = scene.shape_names[idx];
+    if (name.size() <= suffix.size() ||
+        name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0)
+      continue;
+    scene.shapes[idx] = tesselate_beziers(scene.shapes[idx]);
+    name.resize(name.size() - suffix.size());
+  }
+}
+
 // Add missing cameras.
 void add_missing_material(scene_data& scene) {
   auto default_material = invalidid;
@@ -3651,6 +3664,7 @@ static bool load_json_scene(
   }
 
   // fix scene
+  tesselate_bezier_shapes(scene);
   add_missing_camera(scene);
   add_missing_radius(scene);
   trim_memory(scene);
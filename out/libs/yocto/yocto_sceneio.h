@@ -203,7 +203,10 @@ scene_data make_scene_preset(const string& type);
 // Add environment
 io_status add_environment(scene_data& scene, const string& filename);
 
-// Load/save a scene in the supported formats.
+// Load/save a scene in the supported formats. In JSON scenes, line shapes
+// whose name ends in `_bezier` hold cubic Bezier curves, as written by the
+// hair generators, and are tesselated to polylines on load, dropping the
+// suffix from their name.
 bool load_scene(const string& filename, scene_data& scene, string& error,
     bool noparallel = false);
 bool save_scene(const string& filename, const scene_data& scene, string& error,
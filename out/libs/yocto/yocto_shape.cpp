@@ -295,6 +295,48 @@ void quads_to_triangles_inplace(shape_data& shape) {
   shape.quads     = {};
 }
 
+// Tesselate Bezier curves
+shape_data tesselate_beziers(const shape_data& shape, int steps) {
+  // curves from their control polygons, joining curves that share endpoints
+  auto num_curves = (int)shape.lines.size() / 3;
+  auto beziers    = vector<vec4i>(num_curves);
+  auto starts     = vector<int>(num_curves + 1, 0);
+  for (auto curve = 0; curve < num_curves; curve++) {
+    auto l0 = shape.lines[curve * 3 + 0], l1 = shape.lines[curve * 3 + 1],
+         l2 = shape.lines[curve * 3 + 2];
+    beziers[curve]    = {l0.x, l0.y, l1.y, l2.y};
+    auto joined       = curve > 0 && beziers[curve - 1].w == beziers[curve].x;
+    starts[curve + 1] = starts[curve] + steps + (joined ? 0 : 1);
+  }
+
+  // evaluate the curves
+  auto tesselated = shape_data{};
+  auto size       = starts.back();
+  tesselated.positions.resize(size);
+  tesselated.colors.resize(shape.colors.empty() ? 0 : size);
+  tesselated.radius.resize(shape.radius.empty() ? 0 : size);
+  tesselated.lines.resize(num_curves * steps);
+  for (auto curve = 0; curve < num_curves; curve++) {
+    auto& b     = beziers[curve];
+    auto  first = starts[curve + 1] - steps - 1;
+    for (auto s = 0; s <= steps; s++) {
+      auto u = (float)s / (float)steps;
+      tesselated.positions[first + s] = interpolate_bezier(shape.positions[b.x],
+          shape.positions[b.y], shape.positions[b.z], shape.positions[b.w], u);
+      if (!shape.colors.empty())
+        tesselated.colors[first + s] = interpolate_bezier(shape.colors[b.x],
+            shape.colors[b.y], shape.colors[b.z], shape.colors[b.w], u);
+      if (!shape.radius.empty())
+        tesselated.radius[first + s] = interpolate_bezier(shape.radius[b.x],
+            shape.radius[b.y], shape.radius[b.z], shape.radius[b.w], u);
+      if (s < steps)
+        tesselated.lines[curve * steps + s] = {first + s, first + s + 1};
+    }
+  }
+  tesselated.normals = lines_tangents(tesselated.lines, tesselated.positions);
+  return tesselated;
+}
+
 // Subdivision
 shape_data subdivide_shape(
     const shape_data& shape, int subdivisions, bool catmullclark) {
@@ -2554,6 +2596,144 @@ void find_neighbors(const hash_grid& grid, vector<int>& neighbors, int vertex,
   find_neighbors(grid, neighbors, grid.positions[vertex], max_radius, vertex);
 }
 
+// Gets the cell of a point in a flat grid
+static vec3i get_cell_index(const flat_grid& grid, const vec3f& position) {
+  auto scaledpos = position * grid.cell_inv_size;
+  return vec3i{(int)std::floor(scaledpos.x), (int)std::floor(scaledpos.y),
+      (int)std::floor(scaledpos.z)};
+}
+
+// Hash slot of a cell in a flat grid
+static int get_cell_slot(const flat_grid& grid, const vec3i& cell) {
+  auto hash = (uint32_t)cell.x * 73856093u ^ (uint32_t)cell.y * 19349663u ^
+              (uint32_t)cell.z * 83492791u;
+  return (int)(hash & (uint32_t)(grid.table.size() - 1));
+}
+
+// Finds a cell in a flat grid, or returns -1
+static int find_cell(const flat_grid& grid, const vec3i& cell) {
+  auto mask = (int)grid.table.size() - 1;
+  for (auto slot = get_cell_slot(grid, cell);; slot = (slot + 1) & mask) {
+    auto index = grid.table[slot];
+    if (index < 0 || grid.cell_keys[index] == cell) return index;
+  }
+}
+
+// Interleaves the lower 21 bits of a value with zeros
+static uint64_t morton_spread(uint32_t value) {
+  auto x = (uint64_t)(value & 0x1fffff);
+  x      = (x | x << 32) & 0x1f00000000ffffull;
+  x      = (x | x << 16) & 0x1f0000ff0000ffull;
+  x      = (x | x << 8) & 0x100f00f00f00f00full;
+  x      = (x | x << 4) & 0x10c30c30c30c30c3ull;
+  x      = (x | x << 2) & 0x1249249249249249ull;
+  return x;
+}
+
+// Create a flat_grid
+flat_grid make_flat_grid(const vector<vec3f>& positions, float cell_size) {
+  auto grid          = flat_grid{};
+  grid.cell_size     = cell_size;
+  grid.cell_inv_size = 1 / cell_size;
+  grid.positions     = positions;
+  if (positions.empty()) {
+    grid.cell_starts = {0};
+    grid.table       = {-1};
+    return grid;
+  }
+
+  // sort points by the Morton code of their cell, then by cell and index
+  auto cells    = vector<vec3i>(positions.size());
+  auto min_cell = vec3i{int_max, int_max, int_max};
+  for (auto idx = 0; idx < (int)positions.size(); idx++) {
+    cells[idx] = get_cell_index(grid, positions[idx]);
+    min_cell   = min(min_cell, cells[idx]);
+  }
+  auto codes = vector<uint64_t>(positions.size());
+  for (auto idx = 0; idx < (int)positions.size(); idx++) {
+    auto cell  = cells[idx] - min_cell;
+    codes[idx] = morton_spread(cell.x) | morton_spread(cell.y) << 1 |
+                 morton_spread(cell.z) << 2;
+  }
+  grid.point_ids = vector<int>(positions.size());
+  for (auto idx = 0; idx < (int)positions.size(); idx++)
+    grid.point_ids[idx] = idx;
+  std::sort(grid.point_ids.begin(), grid.point_ids.end(), [&](int a, int b) {
+    if (codes[a] != codes[b]) return codes[a] < codes[b];
+    auto &ca = cells[a], &cb = cells[b];
+    if (ca.x != cb.x) return ca.x < cb.x;
+    if (ca.y != cb.y) return ca.y < cb.y;
+    if (ca.z != cb.z) return ca.z < cb.z;
+    return a < b;
+  });
+
+  // cell ranges
+  grid.points.resize(positions.size());
+  for (auto idx = 0; idx < (int)positions.size(); idx++) {
+    auto id          = grid.point_ids[idx];
+    grid.points[idx] = positions[id];
+    if (idx == 0 || cells[id] != grid.cell_keys.back()) {
+      grid.cell_keys.push_back(cells[id]);
+      grid.cell_starts.push_back(idx);
+    }
+  }
+  grid.cell_starts.push_back((int)positions.size());
+
+  // cell table, at most half full
+  auto table_size = 1;
+  while (table_size < 2 * (int)grid.cell_keys.size()) table_size *= 2;
+  grid.table.assign(table_size, -1);
+  for (auto index = 0; index < (int)grid.cell_keys.size(); index++) {
+    auto slot = get_cell_slot(grid, grid.cell_keys[index]);
+    while (grid.table[slot] >= 0) slot = (slot + 1) & (table_size - 1);
+    grid.table[slot] = index;
+  }
+  return grid;
+}
+
+// Finds the nearest neighbors within a given radius
+static void find_neighbors(const flat_grid& grid, vector<int>& neighbors,
+    const vec3f& position, float max_radius, int skip_id) {
+  auto min_cell           = get_cell_index(grid, position - max_radius);
+  auto max_cell           = get_cell_index(grid, position + max_radius);
+  auto max_radius_squared = max_radius * max_radius;
+  for (auto k = min_cell.z; k <= max_cell.z; k++) {
+    for (auto j = min_cell.y; j <= max_cell.y; j++) {
+      for (auto i = min_cell.x; i <= max_cell.x; i++) {
+        auto index = find_cell(grid, {i, j, k});
+        if (index < 0) continue;
+        for (auto idx = grid.cell_starts[index];
+             idx < grid.cell_starts[index + 1]; idx++) {
+          if (distance_squared(grid.points[idx], position) >
+              max_radius_squared)
+            continue;
+          if (grid.point_ids[idx] == skip_id) continue;
+          neighbors.push_back(grid.point_ids[idx]);
+        }
+      }
+    }
+  }
+}
+void find_neighbors(const flat_grid& grid, vector<int>& neighbors,
+    const vec3f& position, float max_radius) {
+  neighbors.clear();
+  find_neighbors(grid, neighbors, position, max_radius, -1);
+}
+void find_neighbors(const flat_grid& grid, vector<int>& neighbors, int vertex,
+    float max_radius) {
+  neighbors.clear();
+  find_neighbors(grid, neighbors, grid.positions[vertex], max_radius, vertex);
+}
+void find_neighbors(const flat_grid& grid, vector<int>& offsets,
+    vector<int>& neighbors, const vector<vec3f>& positions, float max_radius) {
+  offsets.assign(positions.size() + 1, 0);
+  neighbors.clear();
+  for (auto idx = 0; idx < (int)positions.size(); idx++) {
+    find_neighbors(grid, neighbors, positions[idx], max_radius, -1);
+    offsets[idx + 1] = (int)neighbors.size();
+  }
+}
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
@@ -120,6 +120,11 @@ vector<shape_point> sample_shape(
 shape_data quads_to_triangles(const shape_data& shape);
 void       quads_to_triangles_inplace(shape_data& shape);
 
+// Tesselates cubic Bezier curves, stored as control polygons of three lines
+// each as in `bezier_to_lines()`, to polylines of `steps` lines per curve.
+// Curves that share an endpoint stay joined, and tangents are recomputed.
+shape_data tesselate_beziers(const shape_data& shape, int steps = 8);
+
 // Subdivision
 shape_data subdivide_shape(
     const shape_data& shape, int subdivisions, bool catmullclark);
@@ -585,6 +590,33 @@ void find_neighbors(const hash_grid& grid, vector<int>& neighbors,
 void find_neighbors(const hash_grid& grid, vector<int>& neighbors, int vertex,
     float max_radius);
 
+// A compact grid of cells for static point sets. Points are sorted by cell in
+// Morton order and occupied cells are found with an open addressing table
+// that maps cell keys to ranges of sorted points, so queries read contiguous
+// memory with no per-cell allocations.
+struct flat_grid {
+  float         cell_size     = 0;
+  float         cell_inv_size = 0;
+  vector<vec3f> positions     = {};  // points in input order
+  vector<vec3f> points        = {};  // points sorted by cell
+  vector<int>   point_ids     = {};  // input index of the sorted points
+  vector<vec3i> cell_keys     = {};  // occupied cells
+  vector<int>   cell_starts   = {};  // start of each cell in sorted points
+  vector<int>   table         = {};  // cell index for each hash slot, or -1
+};
+
+// Create a flat_grid
+flat_grid make_flat_grid(const vector<vec3f>& positions, float cell_size);
+// Finds the nearest neighbors within a given radius
+void find_neighbors(const flat_grid& grid, vector<int>& neighbors,
+    const vec3f& position, float max_radius);
+void find_neighbors(const flat_grid& grid, vector<int>& neighbors, int vertex,
+    float max_radius);
+// Finds the neighbors within a given radius of a batch of points. Neighbors
+// of point i are `neighbors[offsets[i]]` to `neighbors[offsets[i + 1] - 1]`.
+void find_neighbors(const flat_grid& grid, vector<int>& offsets,
+    vector<int>& neighbors, const vector<vec3f>& positions, float max_radius);
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
@@ -32,12 +32,50 @@
 
 #include "yocto_model.h"
 
+#include <yocto/yocto_bvh.h>
+#include <yocto/yocto_modelio.h>
+#include <yocto/yocto_parallel.h>
 #include <yocto/yocto_sampling.h>
+#include <yocto/yocto_sceneio.h>
+#include <yocto/yocto_shape.h>
 
 #include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <random>
 #include <iostream>
 
 #include "ext/perlin-noise/noise1234.h"
+#include "yocto_noisegraph.h"
+
+// permutation table of noise1234.cpp, shared by the vectorized noise kernels
+extern unsigned char perm[];
+
+// Vectorized noise kernels are compiled for SSE4 and AVX2 on x64 and chosen
+// at runtime, so the library does not need to be built for a specific CPU.
+#if defined(__x86_64__) || defined(_M_X64)
+#define YOCTO_NOISE_SIMD
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define YOCTO_NOISE_TARGET(name)
+#else
+#define YOCTO_NOISE_TARGET(name) __attribute__((target(name)))
+#endif
+#endif
+
+// Noise caches are memory-mapped on POSIX systems and read otherwise.
+#ifndef _WIN32
+#define YOCTO_NOISE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 // -----------------------------------------------------------------------------
 // USING DIRECTIVES
 // -----------------------------------------------------------------------------
@@ -83,7 +121,36 @@ vec4f hash4(vec3f p) {
   return fract4(sin(q) * 43758.5453);
 }
 
-float voronoise(vec3f x, float u, float v) {
+// Integer hash mixing function (lowbias32 by Chris Wellons).
+uint32_t hash_mix(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7feb352du;
+  x ^= x >> 15;
+  x *= 0x846ca68bu;
+  x ^= x >> 16;
+  return x;
+}
+
+// Per-axis multipliers of the integer cell hash. Since the cell hash is the
+// xor of the per-axis terms, these can be precomputed per axis.
+const auto cell_hash_primes = array<uint32_t, 3>{
+    0x8da6b343u, 0xd8163841u, 0xcb1ab31fu};
+
+// Converts a cell hash to four values in [0,1).
+vec4f hash4i(uint32_t hash) {
+  auto h0 = hash_mix(hash), h1 = hash_mix(h0), h2 = hash_mix(h1),
+       h3 = hash_mix(h2);
+  return vec4f{(float)(h0 >> 8), (float)(h1 >> 8), (float)(h2 >> 8),
+             (float)(h3 >> 8)} /
+         16777216.0f;
+}
+vec4f hash4i(const vec3i& cell) {
+  return hash4i((uint32_t)cell.x * cell_hash_primes[0] ^
+                (uint32_t)cell.y * cell_hash_primes[1] ^
+                (uint32_t)cell.z * cell_hash_primes[2]);
+}
+
+float voronoise(const vec3f& x, float u, float v, bool integer_hash) {
   vec3f floor_point = floor3(x);
   vec3f fract_point = fract3(x);
 
@@ -98,7 +165,11 @@ float voronoise(vec3f x, float u, float v) {
     for (int i = -2; i <= 2; i++) {
       for (int k = -2; k <= 2; k++) {
         vec3f position = vec3f{float(k), float(i), float(j)};
-        vec4f hashed   = hash4(floor_point + position) * vec4f{u, u, u, 1.0f};
+        vec3f cell     = floor_point + position;
+        vec4f hashed =
+            (integer_hash ? hash4i(vec3i{(int)cell.x, (int)cell.y, (int)cell.z})
+                          : hash4(cell)) *
+            vec4f{u, u, u, 1.0f};
         vec3f r = position - fract_point + vec3f{hashed.x, hashed.y, hashed.z};
         float d = length(r);
         long double w = pow(
@@ -110,6 +181,75 @@ float voronoise(vec3f x, float u, float v) {
 
   return va / wt;
 }
+
+float fast_voronoise(const vec3f& x, float u, float v) {
+  auto floor_point = floor3(x);
+  auto fract_point = x - floor_point;
+  auto cell        = vec3i{
+      (int)floor_point.x, (int)floor_point.y, (int)floor_point.z};
+  auto smoothness  = 1.0f + 31.0f * pow(1.0f - v, 4.0f);
+
+  // Cells further than the smoothstep radius have zero weight. The feature
+  // point of the cell at offset o lies in [o, o + u] on each axis, so the
+  // per-axis distances to that range bound the distance to the point. Cells
+  // whose bound exceeds the radius are skipped. Cell hashes are the xor of
+  // per-axis terms, which are computed once for the 5 offsets of each axis.
+  const auto radius = 1.414f;
+  float      gaps[3][5];
+  uint32_t   hashes[3][5];
+  for (auto axis = 0; axis < 3; axis++) {
+    for (auto o = -2; o <= 2; o++) {
+      auto gap = max(max(o - fract_point[axis], fract_point[axis] - (o + u)),
+          0.0f);
+      gaps[axis][o + 2]   = gap * gap;
+      hashes[axis][o + 2] = (uint32_t)(cell[axis] + o) *
+                            cell_hash_primes[axis];
+    }
+  }
+
+  // collect the distances and values of the contributing cells
+  float distances[125], values[125];
+  auto  count = 0;
+  for (auto j = 0; j < 5; j++) {
+    for (auto i = 0; i < 5; i++) {
+      if (gaps[2][j] + gaps[1][i] >= radius * radius) continue;
+      for (auto k = 0; k < 5; k++) {
+        if (gaps[2][j] + gaps[1][i] + gaps[0][k] >= radius * radius) continue;
+        auto hashed = hash4i(hashes[0][k] ^ hashes[1][i] ^ hashes[2][j]);
+        auto r      = vec3f{float(k - 2), float(i - 2), float(j - 2)} -
+                 fract_point + vec3f{hashed.x, hashed.y, hashed.z} * u;
+        distances[count] = length(r);
+        values[count]    = hashed.w;
+        count++;
+      }
+    }
+  }
+
+  // weight the cells, with float pow computed as exp2(log2())
+  auto va = 0.0f, wt = 0.0f;
+  for (auto idx = 0; idx < count; idx++) {
+    auto base = 1 - smoothstep(0.0f, radius, distances[idx]);
+    auto w    = base > 0 ? exp2(smoothness * log2(base)) : 0.0f;
+    va += w * values[idx];
+    wt += w;
+  }
+  return va / wt;
+}
+
+bool check_voronoise(int num, string& error) {
+  auto rng       = make_rng(7);
+  auto max_error = 0.0f;
+  for (auto idx = 0; idx < num; idx++) {
+    auto x     = rand3f(rng) * 200 - 100;
+    auto u     = rand1f(rng), v = rand1f(rng);
+    auto delta = fast_voronoise(x, u, v) - voronoise(x, u, v, true);
+    max_error  = max(max_error, abs(delta));
+  }
+  if (max_error <= voronoise_tolerance) return true;
+  error = "fast voronoise error " + std::to_string(max_error) +
+          " exceeds tolerance";
+  return false;
+}
 ///////////////////////////// end of voronise
 
 ///////////////////////////// cell noise
@@ -159,6 +299,103 @@ float getBorder(vec3f p) {
   return d * (smoothstep(0.0f, 0.05f, d));
 }
 
+void cell_noise(cell_noise_sample* samples, const vec3f* positions, int num,
+    float scale) {
+  // bucket positions by cell, so that neighboring positions share features
+  auto buckets = vector<pair<vec3i, int>>(num);
+  for (auto idx = 0; idx < num; idx++) {
+    auto p       = floor3(positions[idx] * scale);
+    buckets[idx] = {vec3i{(int)p.x, (int)p.y, (int)p.z}, idx};
+  }
+  std::sort(buckets.begin(), buckets.end(), [](auto& a, auto& b) {
+    if (a.first.z != b.first.z) return a.first.z < b.first.z;
+    if (a.first.y != b.first.y) return a.first.y < b.first.y;
+    if (a.first.x != b.first.x) return a.first.x < b.first.x;
+    return a.second < b.second;
+  });
+
+  // Feature points of the 27 neighbor cells, as offset plus jitter. The
+  // border pass of voronoiDistance() tests 125 planes that only depend on
+  // the jitter of the nearest cell, so they are cached per nearest cell as
+  // normal and offset, and each test becomes a dot product.
+  auto features = array<vec3f, 27>{};
+  auto planes   = vector<vec4f>(27 * 125);
+  auto cached   = array<bool, 27>{};
+  for (auto start = 0; start < num;) {
+    auto cell = buckets[start].first;
+    auto end  = start + 1;
+    while (end < num && buckets[end].first == cell) end++;
+
+    auto p = vec3f{(float)cell.x, (float)cell.y, (float)cell.z};
+    for (auto k = -1, n = 0; k <= 1; k++) {
+      for (auto j = -1; j <= 1; j++) {
+        for (auto i = -1; i <= 1; i++, n++) {
+          auto b      = vec3f{(float)i, (float)j, (float)k};
+          auto hash   = hash4(p + b);
+          features[n] = b + vec3f{hash.x, hash.y, hash.z};
+        }
+      }
+    }
+    cached.fill(false);
+
+    for (auto bucket = start; bucket < end; bucket++) {
+      auto idx = buckets[bucket].second;
+      auto f   = fract3(positions[idx] * scale);
+
+      // nearest and second nearest feature points
+      auto res = 8.0f, res2 = 8.0f;
+      auto mn  = 0;
+      for (auto n = 0; n < 27; n++) {
+        auto r = features[n] - f;
+        auto d = dot(r, r);
+        if (d < res) {
+          res2 = res;
+          res  = d;
+          mn   = n;
+        } else if (d < res2) {
+          res2 = d;
+        }
+      }
+      samples[idx].f1 = sqrt(res);
+      samples[idx].f2 = sqrt(res2);
+
+      // distance to the border
+      auto cell_planes = planes.data() + mn * 125;
+      auto mb = vec3f{(float)(mn % 3 - 1), (float)(mn / 3 % 3 - 1),
+          (float)(mn / 9 - 1)};
+      if (!cached[mn]) {
+        auto o = features[mn] - mb;
+        for (auto k = -2, n = 0; k <= 2; k++) {
+          for (auto j = -2; j <= 2; j++) {
+            for (auto i = -2; i <= 2; i++, n++) {
+              auto c         = vec3f{(float)i, (float)j, (float)k};
+              auto normal    = normalize(c - o);
+              cell_planes[n] = {normal.x, normal.y, normal.z,
+                  dot(0.5f * (c + o), normal)};
+            }
+          }
+        }
+        cached[mn] = true;
+      }
+      auto q      = mb - f;
+      auto border = 8.0f;
+      for (auto n = 0; n < 125; n++) {
+        auto& plane = cell_planes[n];
+        border      = min(border,
+                 q.x * plane.x + q.y * plane.y + q.z * plane.z + plane.w);
+      }
+      samples[idx].border = border;
+    }
+    start = end;
+  }
+}
+
+void cell_noise(vector<cell_noise_sample>& samples,
+    const vector<vec3f>& positions, float scale) {
+  samples.resize(positions.size());
+  cell_noise(samples.data(), positions.data(), (int)positions.size(), scale);
+}
+
 //////////////////////////// smoothVoronoi
 
 float smoothVoronoi(vec3f x) {
@@ -207,13 +444,709 @@ float ridge(const vec3f& p, int octaves) {
   auto weight = 0.5f;
   auto scale  = 1.0f;
   for (auto octave = 0; octave < octaves; octave++) {
-    sum += weight * (1 - fabs(noise(p * scale))) * (1 - fabs(noise(p * scale)));
+    auto ridge = 1 - fabs(noise(p * scale));
+    sum += weight * ridge * ridge;
     weight /= 2;
     scale *= 2;
   }
   return sum;
 }
 
+///////////////////////////// batched noise
+
+// Kernel that evaluates Perlin noise at `num` points stored as separate x, y
+// and z arrays. The SIMD kernels reproduce ::noise3 operation by operation,
+// so all kernels return the same values.
+using noise_kernel = void (*)(
+    float* values, const float* x, const float* y, const float* z, int num);
+
+void noise_scalar(
+    float* values, const float* x, const float* y, const float* z, int num) {
+  for (auto idx = 0; idx < num; idx++)
+    values[idx] = ::noise3(x[idx], y[idx], z[idx]);
+}
+
+// Gradient dot product of noise3() at a lattice corner, that also returns the
+// gradient vector.
+static float corner_gradient(int hash, float x, float y, float z, vec3f& g) {
+  auto h  = hash & 15;
+  auto u  = h < 8 ? x : y;
+  auto v  = h < 4 ? y : h == 12 || h == 14 ? x : z;
+  auto gu = h < 8 ? vec3f{1, 0, 0} : vec3f{0, 1, 0};
+  auto gv = h < 4                      ? vec3f{0, 1, 0}
+            : h == 12 || h == 14 ? vec3f{1, 0, 0}
+                                       : vec3f{0, 0, 1};
+  g       = ((h & 1) ? -gu : gu) + ((h & 2) ? -gv : gv);
+  return ((h & 1) ? -u : u) + ((h & 2) ? -v : v);
+}
+
+// Perlin noise with its analytic gradient. The value is computed with the
+// same operations as noise3(), and the gradient is carried through each
+// interpolation together with the derivative of the fade curves.
+static float noise(const vec3f& p, vec3f& gradient) {
+  auto fast_floor = [](float x) { return (int)x < x ? (int)x : (int)x - 1; };
+  auto fade  = [](float t) { return t * t * t * (t * (t * 6 - 15) + 10); };
+  auto dfade = [](float t) { return 30 * t * t * (t * (t - 2) + 1); };
+  auto lerp  = [](float t, float a, float b) { return a + t * (b - a); };
+
+  auto ix0 = fast_floor(p.x), iy0 = fast_floor(p.y), iz0 = fast_floor(p.z);
+  auto fx0 = p.x - ix0, fy0 = p.y - iy0, fz0 = p.z - iz0;
+  auto fx1 = fx0 - 1.0f, fy1 = fy0 - 1.0f, fz1 = fz0 - 1.0f;
+  auto ix1 = (ix0 + 1) & 0xff, iy1 = (iy0 + 1) & 0xff, iz1 = (iz0 + 1) & 0xff;
+  ix0 &= 0xff;
+  iy0 &= 0xff;
+  iz0 &= 0xff;
+  auto r = fade(fz0), t = fade(fy0), s = fade(fx0);
+  auto dr = dfade(fz0), dt = dfade(fy0), ds = dfade(fx0);
+
+  // interpolates along z the corners at a given x and y
+  auto lerp_z = [&](int ix, int iy, float fx, float fy, vec3f& g) {
+    auto g0 = zero3f, g1 = zero3f;
+    auto n0 = corner_gradient(perm[ix + perm[iy + perm[iz0]]], fx, fy, fz0, g0);
+    auto n1 = corner_gradient(perm[ix + perm[iy + perm[iz1]]], fx, fy, fz1, g1);
+    g       = g0 + r * (g1 - g0) + vec3f{0, 0, dr * (n1 - n0)};
+    return lerp(r, n0, n1);
+  };
+  // interpolates along y and z the corners at a given x
+  auto lerp_yz = [&](int ix, float fx, vec3f& g) {
+    auto g0 = zero3f, g1 = zero3f;
+    auto n0 = lerp_z(ix, iy0, fx, fy0, g0);
+    auto n1 = lerp_z(ix, iy1, fx, fy1, g1);
+    g       = g0 + t * (g1 - g0) + vec3f{0, dt * (n1 - n0), 0};
+    return lerp(t, n0, n1);
+  };
+
+  auto g0  = zero3f, g1 = zero3f;
+  auto n0  = lerp_yz(ix0, fx0, g0);
+  auto n1  = lerp_yz(ix1, fx1, g1);
+  gradient = 0.936f * (g0 + s * (g1 - g0) + vec3f{ds * (n1 - n0), 0, 0});
+  return 0.936f * (lerp(s, n0, n1));
+}
+
+// Kernel that evaluates Perlin noise and its gradient at `num` points.
+using noise_gradient_kernel = void (*)(float* values, float* dx, float* dy,
+    float* dz, const float* x, const float* y, const float* z, int num);
+
+void noise_gradient_scalar(float* values, float* dx, float* dy, float* dz,
+    const float* x, const float* y, const float* z, int num) {
+  for (auto idx = 0; idx < num; idx++) {
+    auto gradient = zero3f;
+    values[idx]   = noise({x[idx], y[idx], z[idx]}, gradient);
+    dx[idx]       = gradient.x;
+    dy[idx]       = gradient.y;
+    dz[idx]       = gradient.z;
+  }
+}
+
+#ifdef YOCTO_NOISE_SIMD
+
+// permutation table of noise1234 widened to ints for vector gathers
+const auto noise_perm = []() {
+  auto table = array<int, 512>{};
+  for (auto idx = 0; idx < 512; idx++) table[idx] = perm[idx];
+  return table;
+}();
+
+YOCTO_NOISE_TARGET("sse4.1")
+inline __m128i gather_sse4(const int* table, __m128i idx) {
+  return _mm_set_epi32(table[_mm_extract_epi32(idx, 3)],
+      table[_mm_extract_epi32(idx, 2)], table[_mm_extract_epi32(idx, 1)],
+      table[_mm_extract_epi32(idx, 0)]);
+}
+YOCTO_NOISE_TARGET("sse4.1")
+inline __m128i hash_sse4(const int* table, __m128i i, __m128i p) {
+  return gather_sse4(table, _mm_add_epi32(i, p));
+}
+YOCTO_NOISE_TARGET("sse4.1")
+inline __m128 fade_sse4(__m128 t) {
+  auto t3 = _mm_mul_ps(_mm_mul_ps(t, t), t);
+  auto t6 = _mm_sub_ps(_mm_mul_ps(t, _mm_set1_ps(6)), _mm_set1_ps(15));
+  return _mm_mul_ps(t3, _mm_add_ps(_mm_mul_ps(t, t6), _mm_set1_ps(10)));
+}
+YOCTO_NOISE_TARGET("sse4.1")
+inline __m128 lerp_sse4(__m128 t, __m128 a, __m128 b) {
+  return _mm_add_ps(a, _mm_mul_ps(t, _mm_sub_ps(b, a)));
+}
+YOCTO_NOISE_TARGET("sse4.1")
+inline __m128i floor_sse4(__m128 x) {
+  auto i = _mm_cvttps_epi32(x);
+  auto m = _mm_castps_si128(_mm_cmplt_ps(_mm_cvtepi32_ps(i), x));
+  return _mm_sub_epi32(i, _mm_andnot_si128(m, _mm_set1_epi32(1)));
+}
+YOCTO_NOISE_TARGET("sse4.1")
+inline __m128 grad3_sse4(__m128i hash, __m128 x, __m128 y, __m128 z) {
+  auto h   = _mm_and_si128(hash, _mm_set1_epi32(15));
+  auto h8  = _mm_castsi128_ps(_mm_cmplt_epi32(h, _mm_set1_epi32(8)));
+  auto h4  = _mm_castsi128_ps(_mm_cmplt_epi32(h, _mm_set1_epi32(4)));
+  auto h12 = _mm_castsi128_ps(
+      _mm_or_si128(_mm_cmpeq_epi32(h, _mm_set1_epi32(12)),
+          _mm_cmpeq_epi32(h, _mm_set1_epi32(14))));
+  auto u  = _mm_blendv_ps(y, x, h8);
+  auto v  = _mm_blendv_ps(_mm_blendv_ps(z, x, h12), y, h4);
+  auto su = _mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(1)), 31);
+  auto sv = _mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(2)), 30);
+  return _mm_add_ps(_mm_xor_ps(u, _mm_castsi128_ps(su)),
+      _mm_xor_ps(v, _mm_castsi128_ps(sv)));
+}
+
+YOCTO_NOISE_TARGET("sse4.1")
+void noise_sse4(
+    float* values, const float* x, const float* y, const float* z, int num) {
+  auto idx = 0;
+  for (; idx + 4 <= num; idx += 4) {
+    auto px  = _mm_loadu_ps(x + idx);
+    auto py  = _mm_loadu_ps(y + idx);
+    auto pz  = _mm_loadu_ps(z + idx);
+    auto ix0 = floor_sse4(px), iy0 = floor_sse4(py), iz0 = floor_sse4(pz);
+    auto fx0 = _mm_sub_ps(px, _mm_cvtepi32_ps(ix0));
+    auto fy0 = _mm_sub_ps(py, _mm_cvtepi32_ps(iy0));
+    auto fz0 = _mm_sub_ps(pz, _mm_cvtepi32_ps(iz0));
+    auto fx1 = _mm_sub_ps(fx0, _mm_set1_ps(1));
+    auto fy1 = _mm_sub_ps(fy0, _mm_set1_ps(1));
+    auto fz1 = _mm_sub_ps(fz0, _mm_set1_ps(1));
+    auto one = _mm_set1_epi32(1), mask = _mm_set1_epi32(0xff);
+    auto ix1 = _mm_and_si128(_mm_add_epi32(ix0, one), mask);
+    auto iy1 = _mm_and_si128(_mm_add_epi32(iy0, one), mask);
+    auto iz1 = _mm_and_si128(_mm_add_epi32(iz0, one), mask);
+    ix0      = _mm_and_si128(ix0, mask);
+    iy0      = _mm_and_si128(iy0, mask);
+    iz0      = _mm_and_si128(iz0, mask);
+
+    auto r = fade_sse4(fz0), t = fade_sse4(fy0), s = fade_sse4(fx0);
+
+    auto table = noise_perm.data();
+    auto pz0   = gather_sse4(table, iz0);
+    auto pz1   = gather_sse4(table, iz1);
+    auto p00   = hash_sse4(table, iy0, pz0);
+    auto p01   = hash_sse4(table, iy0, pz1);
+    auto p10   = hash_sse4(table, iy1, pz0);
+    auto p11   = hash_sse4(table, iy1, pz1);
+
+    auto nx0 = lerp_sse4(r,
+        grad3_sse4(hash_sse4(table, ix0, p00), fx0, fy0, fz0),
+        grad3_sse4(hash_sse4(table, ix0, p01), fx0, fy0, fz1));
+    auto nx1 = lerp_sse4(r,
+        grad3_sse4(hash_sse4(table, ix0, p10), fx0, fy1, fz0),
+        grad3_sse4(hash_sse4(table, ix0, p11), fx0, fy1, fz1));
+    auto n0  = lerp_sse4(t, nx0, nx1);
+    nx0      = lerp_sse4(r,
+        grad3_sse4(hash_sse4(table, ix1, p00), fx1, fy0, fz0),
+        grad3_sse4(hash_sse4(table, ix1, p01), fx1, fy0, fz1));
+    nx1      = lerp_sse4(r,
+        grad3_sse4(hash_sse4(table, ix1, p10), fx1, fy1, fz0),
+        grad3_sse4(hash_sse4(table, ix1, p11), fx1, fy1, fz1));
+    auto n1  = lerp_sse4(t, nx0, nx1);
+
+    _mm_storeu_ps(
+        values + idx, _mm_mul_ps(_mm_set1_ps(0.936f), lerp_sse4(s, n0, n1)));
+  }
+  noise_scalar(values + idx, x + idx, y + idx, z + idx, num - idx);
+}
+
+// Derivative of the fade curve.
+YOCTO_NOISE_TARGET("sse4.1")
+inline __m128 dfade_sse4(__m128 t) {
+  auto t2 = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(30), t), t);
+  auto t1 = _mm_sub_ps(t, _mm_set1_ps(2));
+  return _mm_mul_ps(t2, _mm_add_ps(_mm_mul_ps(t, t1), _mm_set1_ps(1)));
+}
+// Same as grad3_sse4(), also returning the gradient vector in `g`.
+YOCTO_NOISE_TARGET("sse4.1")
+inline __m128 grad3d_sse4(
+    __m128i hash, __m128 x, __m128 y, __m128 z, __m128* g) {
+  auto h   = _mm_and_si128(hash, _mm_set1_epi32(15));
+  auto h8  = _mm_castsi128_ps(_mm_cmplt_epi32(h, _mm_set1_epi32(8)));
+  auto h4  = _mm_castsi128_ps(_mm_cmplt_epi32(h, _mm_set1_epi32(4)));
+  auto h12 = _mm_castsi128_ps(
+      _mm_or_si128(_mm_cmpeq_epi32(h, _mm_set1_epi32(12)),
+          _mm_cmpeq_epi32(h, _mm_set1_epi32(14))));
+  auto su  = _mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(1)), 31);
+  auto sv  = _mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(2)), 30);
+  auto gu  = _mm_xor_ps(_mm_set1_ps(1), _mm_castsi128_ps(su));
+  auto gv  = _mm_xor_ps(_mm_set1_ps(1), _mm_castsi128_ps(sv));
+  auto gx  = _mm_andnot_ps(h4, h12);
+  g[0]     = _mm_add_ps(_mm_and_ps(h8, gu), _mm_and_ps(gx, gv));
+  g[1]     = _mm_add_ps(_mm_andnot_ps(h8, gu), _mm_and_ps(h4, gv));
+  g[2]     = _mm_andnot_ps(_mm_or_ps(h4, h12), gv);
+  return grad3_sse4(hash, x, y, z);
+}
+// Interpolates values `a` and `b` with gradients `ga` and `gb` along `axis`,
+// where `dt` is the derivative of `t`.
+YOCTO_NOISE_TARGET("sse4.1")
+inline __m128 lerpd_sse4(__m128 t, __m128 dt, int axis, __m128 a,
+    const __m128* ga, __m128 b, const __m128* gb, __m128* g) {
+  for (auto k = 0; k < 3; k++) g[k] = lerp_sse4(t, ga[k], gb[k]);
+  g[axis] = _mm_add_ps(g[axis], _mm_mul_ps(dt, _mm_sub_ps(b, a)));
+  return lerp_sse4(t, a, b);
+}
+
+YOCTO_NOISE_TARGET("sse4.1")
+void noise_gradient_sse4(float* values, float* dx, float* dy, float* dz,
+    const float* x, const float* y, const float* z, int num) {
+  auto idx = 0;
+  for (; idx + 4 <= num; idx += 4) {
+    auto px  = _mm_loadu_ps(x + idx);
+    auto py  = _mm_loadu_ps(y + idx);
+    auto pz  = _mm_loadu_ps(z + idx);
+    auto ix0 = floor_sse4(px), iy0 = floor_sse4(py), iz0 = floor_sse4(pz);
+    auto fx0 = _mm_sub_ps(px, _mm_cvtepi32_ps(ix0));
+    auto fy0 = _mm_sub_ps(py, _mm_cvtepi32_ps(iy0));
+    auto fz0 = _mm_sub_ps(pz, _mm_cvtepi32_ps(iz0));
+    auto fx1 = _mm_sub_ps(fx0, _mm_set1_ps(1));
+    auto fy1 = _mm_sub_ps(fy0, _mm_set1_ps(1));
+    auto fz1 = _mm_sub_ps(fz0, _mm_set1_ps(1));
+    auto one = _mm_set1_epi32(1), mask = _mm_set1_epi32(0xff);
+    auto ix1 = _mm_and_si128(_mm_add_epi32(ix0, one), mask);
+    auto iy1 = _mm_and_si128(_mm_add_epi32(iy0, one), mask);
+    auto iz1 = _mm_and_si128(_mm_add_epi32(iz0, one), mask);
+    ix0      = _mm_and_si128(ix0, mask);
+    iy0      = _mm_and_si128(iy0, mask);
+    iz0      = _mm_and_si128(iz0, mask);
+
+    auto r = fade_sse4(fz0), t = fade_sse4(fy0), s = fade_sse4(fx0);
+    auto dr = dfade_sse4(fz0), dt = dfade_sse4(fy0), ds = dfade_sse4(fx0);
+
+    auto table = noise_perm.data();
+    auto pz0   = gather_sse4(table, iz0);
+    auto pz1   = gather_sse4(table, iz1);
+    auto p00   = hash_sse4(table, iy0, pz0);
+    auto p01   = hash_sse4(table, iy0, pz1);
+    auto p10   = hash_sse4(table, iy1, pz0);
+    auto p11   = hash_sse4(table, iy1, pz1);
+
+    // corners along z, then y, then x
+    __m128 ga[3], gb[3], gx0[3], gx1[3], g0[3], g1[3], g[3];
+    auto na  = grad3d_sse4(hash_sse4(table, ix0, p00), fx0, fy0, fz0, ga);
+    auto nb  = grad3d_sse4(hash_sse4(table, ix0, p01), fx0, fy0, fz1, gb);
+    auto nx0 = lerpd_sse4(r, dr, 2, na, ga, nb, gb, gx0);
+    na       = grad3d_sse4(hash_sse4(table, ix0, p10), fx0, fy1, fz0, ga);
+    nb       = grad3d_sse4(hash_sse4(table, ix0, p11), fx0, fy1, fz1, gb);
+    auto nx1 = lerpd_sse4(r, dr, 2, na, ga, nb, gb, gx1);
+    auto n0  = lerpd_sse4(t, dt, 1, nx0, gx0, nx1, gx1, g0);
+    na       = grad3d_sse4(hash_sse4(table, ix1, p00), fx1, fy0, fz0, ga);
+    nb       = grad3d_sse4(hash_sse4(table, ix1, p01), fx1, fy0, fz1, gb);
+    nx0      = lerpd_sse4(r, dr, 2, na, ga, nb, gb, gx0);
+    na       = grad3d_sse4(hash_sse4(table, ix1, p10), fx1, fy1, fz0, ga);
+    nb       = grad3d_sse4(hash_sse4(table, ix1, p11), fx1, fy1, fz1, gb);
+    nx1      = lerpd_sse4(r, dr, 2, na, ga, nb, gb, gx1);
+    auto n1  = lerpd_sse4(t, dt, 1, nx0, gx0, nx1, gx1, g1);
+    auto n   = lerpd_sse4(s, ds, 0, n0, g0, n1, g1, g);
+
+    auto scale = _mm_set1_ps(0.936f);
+    _mm_storeu_ps(values + idx, _mm_mul_ps(scale, n));
+    _mm_storeu_ps(dx + idx, _mm_mul_ps(scale, g[0]));
+    _mm_storeu_ps(dy + idx, _mm_mul_ps(scale, g[1]));
+    _mm_storeu_ps(dz + idx, _mm_mul_ps(scale, g[2]));
+  }
+  noise_gradient_scalar(values + idx, dx + idx, dy + idx, dz + idx, x + idx,
+      y + idx, z + idx, num - idx);
+}
+
+YOCTO_NOISE_TARGET("avx2")
+inline __m256i gather_avx2(const int* table, __m256i idx) {
+  return _mm256_i32gather_epi32(table, idx, 4);
+}
+YOCTO_NOISE_TARGET("avx2")
+inline __m256i hash_avx2(const int* table, __m256i i, __m256i p) {
+  return gather_avx2(table, _mm256_add_epi32(i, p));
+}
+YOCTO_NOISE_TARGET("avx2")
+inline __m256 fade_avx2(__m256 t) {
+  auto t3 = _mm256_mul_ps(_mm256_mul_ps(t, t), t);
+  auto t6 = _mm256_sub_ps(
+      _mm256_mul_ps(t, _mm256_set1_ps(6)), _mm256_set1_ps(15));
+  return _mm256_mul_ps(
+      t3, _mm256_add_ps(_mm256_mul_ps(t, t6), _mm256_set1_ps(10)));
+}
+YOCTO_NOISE_TARGET("avx2")
+inline __m256 lerp_avx2(__m256 t, __m256 a, __m256 b) {
+  return _mm256_add_ps(a, _mm256_mul_ps(t, _mm256_sub_ps(b, a)));
+}
+YOCTO_NOISE_TARGET("avx2")
+inline __m256i floor_avx2(__m256 x) {
+  auto i = _mm256_cvttps_epi32(x);
+  auto m = _mm256_castps_si256(
+      _mm256_cmp_ps(_mm256_cvtepi32_ps(i), x, _CMP_LT_OQ));
+  return _mm256_sub_epi32(i, _mm256_andnot_si256(m, _mm256_set1_epi32(1)));
+}
+YOCTO_NOISE_TARGET("avx2")
+inline __m256 grad3_avx2(__m256i hash, __m256 x, __m256 y, __m256 z) {
+  auto h   = _mm256_and_si256(hash, _mm256_set1_epi32(15));
+  auto h8  = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(8), h));
+  auto h4  = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(4), h));
+  auto h12 = _mm256_castsi256_ps(
+      _mm256_or_si256(_mm256_cmpeq_epi32(h, _mm256_set1_epi32(12)),
+          _mm256_cmpeq_epi32(h, _mm256_set1_epi32(14))));
+  auto u  = _mm256_blendv_ps(y, x, h8);
+  auto v  = _mm256_blendv_ps(_mm256_blendv_ps(z, x, h12), y, h4);
+  auto su = _mm256_slli_epi32(_mm256_and_si256(h, _mm256_set1_epi32(1)), 31);
+  auto sv = _mm256_slli_epi32(_mm256_and_si256(h, _mm256_set1_epi32(2)), 30);
+  return _mm256_add_ps(_mm256_xor_ps(u, _mm256_castsi256_ps(su)),
+      _mm256_xor_ps(v, _mm256_castsi256_ps(sv)));
+}
+
+// FMA is deliberately not enabled, so that the compiler does not contract
+// the kernel differently from the scalar code.
+YOCTO_NOISE_TARGET("avx2")
+void noise_avx2(
+    float* values, const float* x, const float* y, const float* z, int num) {
+  auto idx = 0;
+  for (; idx + 8 <= num; idx += 8) {
+    auto px  = _mm256_loadu_ps(x + idx);
+    auto py  = _mm256_loadu_ps(y + idx);
+    auto pz  = _mm256_loadu_ps(z + idx);
+    auto ix0 = floor_avx2(px), iy0 = floor_avx2(py), iz0 = floor_avx2(pz);
+    auto fx0 = _mm256_sub_ps(px, _mm256_cvtepi32_ps(ix0));
+    auto fy0 = _mm256_sub_ps(py, _mm256_cvtepi32_ps(iy0));
+    auto fz0 = _mm256_sub_ps(pz, _mm256_cvtepi32_ps(iz0));
+    auto fx1 = _mm256_sub_ps(fx0, _mm256_set1_ps(1));
+    auto fy1 = _mm256_sub_ps(fy0, _mm256_set1_ps(1));
+    auto fz1 = _mm256_sub_ps(fz0, _mm256_set1_ps(1));
+    auto one = _mm256_set1_epi32(1), mask = _mm256_set1_epi32(0xff);
+    auto ix1 = _mm256_and_si256(_mm256_add_epi32(ix0, one), mask);
+    auto iy1 = _mm256_and_si256(_mm256_add_epi32(iy0, one), mask);
+    auto iz1 = _mm256_and_si256(_mm256_add_epi32(iz0, one), mask);
+    ix0      = _mm256_and_si256(ix0, mask);
+    iy0      = _mm256_and_si256(iy0, mask);
+    iz0      = _mm256_and_si256(iz0, mask);
+
+    auto r = fade_avx2(fz0), t = fade_avx2(fy0), s = fade_avx2(fx0);
+
+    auto table = noise_perm.data();
+    auto pz0   = gather_avx2(table, iz0);
+    auto pz1   = gather_avx2(table, iz1);
+    auto p00   = hash_avx2(table, iy0, pz0);
+    auto p01   = hash_avx2(table, iy0, pz1);
+    auto p10   = hash_avx2(table, iy1, pz0);
+    auto p11   = hash_avx2(table, iy1, pz1);
+
+    auto nx0 = lerp_avx2(r,
+        grad3_avx2(hash_avx2(table, ix0, p00), fx0, fy0, fz0),
+        grad3_avx2(hash_avx2(table, ix0, p01), fx0, fy0, fz1));
+    auto nx1 = lerp_avx2(r,
+        grad3_avx2(hash_avx2(table, ix0, p10), fx0, fy1, fz0),
+        grad3_avx2(hash_avx2(table, ix0, p11), fx0, fy1, fz1));
+    auto n0  = lerp_avx2(t, nx0, nx1);
+    nx0      = lerp_avx2(r,
+        grad3_avx2(hash_avx2(table, ix1, p00), fx1, fy0, fz0),
+        grad3_avx2(hash_avx2(table, ix1, p01), fx1, fy0, fz1));
+    nx1      = lerp_avx2(r,
+        grad3_avx2(hash_avx2(table, ix1, p10), fx1, fy1, fz0),
+        grad3_avx2(hash_avx2(table, ix1, p11), fx1, fy1, fz1));
+    auto n1  = lerp_avx2(t, nx0, nx1);
+
+    _mm256_storeu_ps(values + idx,
+        _mm256_mul_ps(_mm256_set1_ps(0.936f), lerp_avx2(s, n0, n1)));
+  }
+  noise_scalar(values + idx, x + idx, y + idx, z + idx, num - idx);
+}
+
+// Derivative of the fade curve.
+YOCTO_NOISE_TARGET("avx2")
+inline __m256 dfade_avx2(__m256 t) {
+  auto t2 = _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(30), t), t);
+  auto t1 = _mm256_sub_ps(t, _mm256_set1_ps(2));
+  return _mm256_mul_ps(
+      t2, _mm256_add_ps(_mm256_mul_ps(t, t1), _mm256_set1_ps(1)));
+}
+// Same as grad3_avx2(), also returning the gradient vector in `g`.
+YOCTO_NOISE_TARGET("avx2")
+inline __m256 grad3d_avx2(
+    __m256i hash, __m256 x, __m256 y, __m256 z, __m256* g) {
+  auto h   = _mm256_and_si256(hash, _mm256_set1_epi32(15));
+  auto h8  = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(8), h));
+  auto h4  = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(4), h));
+  auto h12 = _mm256_castsi256_ps(
+      _mm256_or_si256(_mm256_cmpeq_epi32(h, _mm256_set1_epi32(12)),
+          _mm256_cmpeq_epi32(h, _mm256_set1_epi32(14))));
+  auto su  = _mm256_slli_epi32(_mm256_and_si256(h, _mm256_set1_epi32(1)), 31);
+  auto sv  = _mm256_slli_epi32(_mm256_and_si256(h, _mm256_set1_epi32(2)), 30);
+  auto gu  = _mm256_xor_ps(_mm256_set1_ps(1), _mm256_castsi256_ps(su));
+  auto gv  = _mm256_xor_ps(_mm256_set1_ps(1), _mm256_castsi256_ps(sv));
+  auto gx  = _mm256_andnot_ps(h4, h12);
+  g[0]     = _mm256_add_ps(_mm256_and_ps(h8, gu), _mm256_and_ps(gx, gv));
+  g[1]     = _mm256_add_ps(_mm256_andnot_ps(h8, gu), _mm256_and_ps(h4, gv));
+  g[2]     = _mm256_andnot_ps(_mm256_or_ps(h4, h12), gv);
+  return grad3_avx2(hash, x, y, z);
+}
+// Interpolates values `a` and `b` with gradients `ga` and `gb` along `axis`,
+// where `dt` is the derivative of `t`.
+YOCTO_NOISE_TARGET("avx2")
+inline __m256 lerpd_avx2(__m256 t, __m256 dt, int axis, __m256 a,
+    const __m256* ga, __m256 b, const __m256* gb, __m256* g) {
+  for (auto k = 0; k < 3; k++) g[k] = lerp_avx2(t, ga[k], gb[k]);
+  g[axis] = _mm256_add_ps(g[axis], _mm256_mul_ps(dt, _mm256_sub_ps(b, a)));
+  return lerp_avx2(t, a, b);
+}
+
+YOCTO_NOISE_TARGET("avx2")
+void noise_gradient_avx2(float* values, float* dx, float* dy, float* dz,
+    const float* x, const float* y, const float* z, int num) {
+  auto idx = 0;
+  for (; idx + 8 <= num; idx += 8) {
+    auto px  = _mm256_loadu_ps(x + idx);
+    auto py  = _mm256_loadu_ps(y + idx);
+    auto pz  = _mm256_loadu_ps(z + idx);
+    auto ix0 = floor_avx2(px), iy0 = floor_avx2(py), iz0 = floor_avx2(pz);
+    auto fx0 = _mm256_sub_ps(px, _mm256_cvtepi32_ps(ix0));
+    auto fy0 = _mm256_sub_ps(py, _mm256_cvtepi32_ps(iy0));
+    auto fz0 = _mm256_sub_ps(pz, _mm256_cvtepi32_ps(iz0));
+    auto fx1 = _mm256_sub_ps(fx0, _mm256_set1_ps(1));
+    auto fy1 = _mm256_sub_ps(fy0, _mm256_set1_ps(1));
+    auto fz1 = _mm256_sub_ps(fz0, _mm256_set1_ps(1));
+    auto one = _mm256_set1_epi32(1), mask = _mm256_set1_epi32(0xff);
+    auto ix1 = _mm256_and_si256(_mm256_add_epi32(ix0, one), mask);
+    auto iy1 = _mm256_and_si256(_mm256_add_epi32(iy0, one), mask);
+    auto iz1 = _mm256_and_si256(_mm256_add_epi32(iz0, one), mask);
+    ix0      = _mm256_and_si256(ix0, mask);
+    iy0      = _mm256_and_si256(iy0, mask);
+    iz0      = _mm256_and_si256(iz0, mask);
+
+    auto r = fade_avx2(fz0), t = fade_avx2(fy0), s = fade_avx2(fx0);
+    auto dr = dfade_avx2(fz0), dt = dfade_avx2(fy0), ds = dfade_avx2(fx0);
+
+    auto table = noise_perm.data();
+    auto pz0   = gather_avx2(table, iz0);
+    auto pz1   = gather_avx2(table, iz1);
+    auto p00   = hash_avx2(table, iy0, pz0);
+    auto p01   = hash_avx2(table, iy0, pz1);
+    auto p10   = hash_avx2(table, iy1, pz0);
+    auto p11   = hash_avx2(table, iy1, pz1);
+
+    // corners along z, then y, then x
+    __m256 ga[3], gb[3], gx0[3], gx1[3], g0[3], g1[3], g[3];
+    auto na  = grad3d_avx2(hash_avx2(table, ix0, p00), fx0, fy0, fz0, ga);
+    auto nb  = grad3d_avx2(hash_avx2(table, ix0, p01), fx0, fy0, fz1, gb);
+    auto nx0 = lerpd_avx2(r, dr, 2, na, ga, nb, gb, gx0);
+    na       = grad3d_avx2(hash_avx2(table, ix0, p10), fx0, fy1, fz0, ga);
+    nb       = grad3d_avx2(hash_avx2(table, ix0, p11), fx0, fy1, fz1, gb);
+    auto nx1 = lerpd_avx2(r, dr, 2, na, ga, nb, gb, gx1);
+    auto n0  = lerpd_avx2(t, dt, 1, nx0, gx0, nx1, gx1, g0);
+    na       = grad3d_avx2(hash_avx2(table, ix1, p00), fx1, fy0, fz0, ga);
+    nb       = grad3d_avx2(hash_avx2(table, ix1, p01), fx1, fy0, fz1, gb);
+    nx0      = lerpd_avx2(r, dr, 2, na, ga, nb, gb, gx0);
+    na       = grad3d_avx2(hash_avx2(table, ix1, p10), fx1, fy1, fz0, ga);
+    nb       = grad3d_avx2(hash_avx2(table, ix1, p11), fx1, fy1, fz1, gb);
+    nx1      = lerpd_avx2(r, dr, 2, na, ga, nb, gb, gx1);
+    auto n1  = lerpd_avx2(t, dt, 1, nx0, gx0, nx1, gx1, g1);
+    auto n   = lerpd_avx2(s, ds, 0, n0, g0, n1, g1, g);
+
+    auto scale = _mm256_set1_ps(0.936f);
+    _mm256_storeu_ps(values + idx, _mm256_mul_ps(scale, n));
+    _mm256_storeu_ps(dx + idx, _mm256_mul_ps(scale, g[0]));
+    _mm256_storeu_ps(dy + idx, _mm256_mul_ps(scale, g[1]));
+    _mm256_storeu_ps(dz + idx, _mm256_mul_ps(scale, g[2]));
+  }
+  noise_gradient_scalar(values + idx, dx + idx, dy + idx, dz + idx, x + idx,
+      y + idx, z + idx, num - idx);
+}
+
+bool cpu_supports_avx2() {
+#ifdef _MSC_VER
+  int info[4];
+  __cpuid(info, 1);
+  auto osxsave = (info[2] & (1 << 27)) != 0, avx = (info[2] & (1 << 28)) != 0;
+  if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) return false;
+  __cpuidex(info, 7, 0);
+  return (info[1] & (1 << 5)) != 0;
+#else
+  return __builtin_cpu_supports("avx2");
+#endif
+}
+bool cpu_supports_sse4() {
+#ifdef _MSC_VER
+  int info[4];
+  __cpuid(info, 1);
+  return (info[2] & (1 << 19)) != 0;
+#else
+  return __builtin_cpu_supports("sse4.1");
+#endif
+}
+
+#endif
+
+// Picks the widest noise kernel supported by the running CPU.
+noise_kernel get_noise_kernel() {
+  static const auto kernel = []() -> noise_kernel {
+#ifdef YOCTO_NOISE_SIMD
+    if (cpu_supports_avx2()) return noise_avx2;
+    if (cpu_supports_sse4()) return noise_sse4;
+#endif
+    return noise_scalar;
+  }();
+  return kernel;
+}
+
+// Picks the widest noise gradient kernel supported by the running CPU.
+noise_gradient_kernel get_noise_gradient_kernel() {
+  static const auto kernel = []() -> noise_gradient_kernel {
+#ifdef YOCTO_NOISE_SIMD
+    if (cpu_supports_avx2()) return noise_gradient_avx2;
+    if (cpu_supports_sse4()) return noise_gradient_sse4;
+#endif
+    return noise_gradient_scalar;
+  }();
+  return kernel;
+}
+
+// Evaluates a fractal sum of noise octaves over `num` positions scaled by
+// `scale`. Positions are processed in small chunks transposed to x, y and z
+// arrays, and each octave of a chunk is a single kernel call. `accumulate`
+// combines the octave weight and noise value as the scalar versions do.
+template <typename Accumulate>
+void fractal_noise(float* values, const vec3f* positions, int num, float scale,
+    int octaves, float weight0, Accumulate&& accumulate) {
+  const int chunk_size = 64;
+  auto      kernel     = get_noise_kernel();
+  float     px[chunk_size], py[chunk_size], pz[chunk_size];
+  float     x[chunk_size], y[chunk_size], z[chunk_size], n[chunk_size];
+  for (auto start = 0; start < num; start += chunk_size) {
+    auto count = min(chunk_size, num - start);
+    auto sum   = values + start;
+    for (auto idx = 0; idx < count; idx++) {
+      auto p   = positions[start + idx] * scale;
+      px[idx]  = p.x;
+      py[idx]  = p.y;
+      pz[idx]  = p.z;
+      sum[idx] = 0;
+    }
+    auto weight       = weight0;
+    auto octave_scale = 1.0f;
+    for (auto octave = 0; octave < octaves; octave++) {
+      for (auto idx = 0; idx < count; idx++) {
+        x[idx] = px[idx] * octave_scale;
+        y[idx] = py[idx] * octave_scale;
+        z[idx] = pz[idx] * octave_scale;
+      }
+      kernel(n, x, y, z, count);
+      for (auto idx = 0; idx < count; idx++)
+        sum[idx] += accumulate(weight, n[idx]);
+      weight /= 2;
+      octave_scale *= 2;
+    }
+  }
+}
+
+void noise(float* values, const vec3f* positions, int num, float scale) {
+  fractal_noise(values, positions, num, scale, 1, 1.0f,
+      [](float weight, float n) { return n; });
+}
+void fbm(float* values, const vec3f* positions, int num, float scale,
+    int octaves) {
+  fractal_noise(values, positions, num, scale, octaves, 1.0f,
+      [](float weight, float n) { return weight * fabs(n); });
+}
+void turbulence(float* values, const vec3f* positions, int num, float scale,
+    int octaves) {
+  fractal_noise(values, positions, num, scale, octaves, 1.0f,
+      [](float weight, float n) { return weight * fabs(n); });
+}
+void ridge(float* values, const vec3f* positions, int num, float scale,
+    int octaves) {
+  fractal_noise(values, positions, num, scale, octaves, 0.5f,
+      [](float weight, float n) {
+        auto ridge = 1 - fabs(n);
+        return weight * ridge * ridge;
+      });
+}
+
+void noise(vector<float>& values, const vector<vec3f>& positions, float scale) {
+  values.resize(positions.size());
+  noise(values.data(), positions.data(), (int)positions.size(), scale);
+}
+void fbm(vector<float>& values, const vector<vec3f>& positions, float scale,
+    int octaves) {
+  values.resize(positions.size());
+  fbm(values.data(), positions.data(), (int)positions.size(), scale, octaves);
+}
+void turbulence(vector<float>& values, const vector<vec3f>& positions,
+    float scale, int octaves) {
+  values.resize(positions.size());
+  turbulence(
+      values.data(), positions.data(), (int)positions.size(), scale, octaves);
+}
+void ridge(vector<float>& values, const vector<vec3f>& positions, float scale,
+    int octaves) {
+  values.resize(positions.size());
+  ridge(values.data(), positions.data(), (int)positions.size(), scale, octaves);
+}
+
+// Same as fractal_noise(), also computing the gradient of the sum with
+// respect to the positions. `derivative(weight, n)` is the derivative of
+// `accumulate(weight, n)` with respect to the noise value `n`.
+template <typename Accumulate, typename Derivative>
+void fractal_noise(float* values, vec3f* gradients, const vec3f* positions,
+    int num, float scale, int octaves, float weight0, Accumulate&& accumulate,
+    Derivative&& derivative) {
+  const int chunk_size = 64;
+  auto      kernel     = get_noise_gradient_kernel();
+  float     px[chunk_size], py[chunk_size], pz[chunk_size];
+  float     x[chunk_size], y[chunk_size], z[chunk_size], n[chunk_size];
+  float     dx[chunk_size], dy[chunk_size], dz[chunk_size];
+  vec3f     gradient[chunk_size];
+  for (auto start = 0; start < num; start += chunk_size) {
+    auto count = min(chunk_size, num - start);
+    auto sum   = values + start;
+    for (auto idx = 0; idx < count; idx++) {
+      auto p        = positions[start + idx] * scale;
+      px[idx]       = p.x;
+      py[idx]       = p.y;
+      pz[idx]       = p.z;
+      sum[idx]      = 0;
+      gradient[idx] = zero3f;
+    }
+    auto weight       = weight0;
+    auto octave_scale = 1.0f;
+    for (auto octave = 0; octave < octaves; octave++) {
+      for (auto idx = 0; idx < count; idx++) {
+        x[idx] = px[idx] * octave_scale;
+        y[idx] = py[idx] * octave_scale;
+        z[idx] = pz[idx] * octave_scale;
+      }
+      kernel(n, dx, dy, dz, x, y, z, count);
+      for (auto idx = 0; idx < count; idx++) {
+        sum[idx] += accumulate(weight, n[idx]);
+        gradient[idx] += vec3f{dx[idx], dy[idx], dz[idx]} *
+                         (derivative(weight, n[idx]) * octave_scale);
+      }
+      weight /= 2;
+      octave_scale *= 2;
+    }
+    for (auto idx = 0; idx < count; idx++)
+      gradients[start + idx] = gradient[idx] * scale;
+  }
+}
+
+void fbm(float* values, vec3f* gradients, const vec3f* positions, int num,
+    float scale, int octaves) {
+  fractal_noise(
+      values, gradients, positions, num, scale, octaves, 1.0f,
+      [](float weight, float n) { return weight * fabs(n); },
+      [](float weight, float n) { return n < 0 ? -weight : weight; });
+}
+void turbulence(float* values, vec3f* gradients, const vec3f* positions,
+    int num, float scale, int octaves) {
+  fractal_noise(
+      values, gradients, positions, num, scale, octaves, 1.0f,
+      [](float weight, float n) { return weight * fabs(n); },
+      [](float weight, float n) { return n < 0 ? -weight : weight; });
+}
+void ridge(float* values, vec3f* gradients, const vec3f* positions, int num,
+    float scale, int octaves) {
+  fractal_noise(
+      values, gradients, positions, num, scale, octaves, 0.5f,
+      [](float weight, float n) {
+        auto ridge = 1 - fabs(n);
+        return weight * ridge * ridge;
+      },
+      [](float weight, float n) {
+        auto ridge = 1 - fabs(n);
+        return (float)(2 * weight * ridge * (n < 0 ? 1 : -1));
+      });
+}
+
+///////////////////////////// end of batched noise
+
 void add_polyline(shape_data& shape, const vector<vec3f>& positions,
     const vector<vec4f>& colors, float thickness = 0.0001f) {
   auto offset = (int)shape.positions.size();
@@ -226,327 +1159,1436 @@ void add_polyline(shape_data& shape, const vector<vec3f>& positions,
   }
 }
 
-void sample_shape(vector<vec3f>& positions, vector<vec3f>& normals,
-    vector<vec2f>& texcoords, const shape_data& shape, int num) {
-  auto triangles  = shape.triangles;
-  auto qtriangles = quads_to_triangles(shape.quads);
-  triangles.insert(triangles.end(), qtriangles.begin(), qtriangles.end());
-  auto cdf = sample_triangles_cdf(triangles, shape.positions);
-  auto rng = make_rng(19873991);
-  for (auto idx = 0; idx < num; idx++) {
-    auto [elem, uv] = sample_triangles(cdf, rand1f(rng), rand2f(rng));
-    auto q          = triangles[elem];
-    positions.push_back(interpolate_triangle(
-        shape.positions[q.x], shape.positions[q.y], shape.positions[q.z], uv));
-    normals.push_back(normalize(interpolate_triangle(
-        shape.normals[q.x], shape.normals[q.y], shape.normals[q.z], uv)));
-    if (!texcoords.empty()) {
-      texcoords.push_back(interpolate_triangle(shape.texcoords[q.x],
-          shape.texcoords[q.y], shape.texcoords[q.z], uv));
-    } else {
-      texcoords.push_back(uv);
+// Grows a hair strand of `steps + 1` points from a root.
+static void grow_hair_strand(vec3f* points, const vec3f& root,
+    const vec3f& normal, const hair_params& params) {
+  auto segment_length = params.lenght / params.steps;
+  auto next_point     = root;
+  auto norm           = normal;
+  for (auto s = 0; s <= params.steps; s++) {
+    auto old_point = next_point;
+    points[s]      = old_point;
+    next_point     = ray_point(ray3f{old_point, norm}, segment_length);
+    next_point += noise3(old_point * params.scale) * params.strength;
+    next_point.y -= params.gravity;
+    norm = normalize(next_point - old_point);
+  }
+}
+
+// Fits a strand of `steps + 1` points with `curves` cubic Bezier curves,
+// writing `3 * curves + 1` control points. Curves join at strand points and
+// match the strand direction there, estimated by central differences.
+static void fit_hair_curves(
+    vec3f* controls, const vec3f* points, int steps, int curves) {
+  auto tangent = [points, steps, curves](int knot) {
+    auto idx  = knot * steps / curves;
+    auto prev = max(idx - 1, 0), next = min(idx + 1, steps);
+    return (points[next] - points[prev]) / (float)(next - prev);
+  };
+  for (auto curve = 0; curve < curves; curve++) {
+    auto start = curve * steps / curves, end = (curve + 1) * steps / curves;
+    auto scale = (float)(end - start) / 3;
+    controls[curve * 3 + 0] = points[start];
+    controls[curve * 3 + 1] = points[start] + tangent(curve) * scale;
+    controls[curve * 3 + 2] = points[end] - tangent(curve + 1) * scale;
+  }
+  controls[curves * 3] = points[steps];
+}
+
+// Appends `num_strands` hair strands to `hair`, whose `steps + 1` points
+// are computed by `grow_strand(points, strand)`. Output arrays are sized up
+// front and strands are grown in parallel, each writing its own range, so
+// the result does not depend on scheduling.
+// Strands are polylines of `steps` lines or, if `curves` is not zero, the
+// control polygons of that many cubic Bezier curves, stored as in
+// `bezier_to_lines()`. Tangents are accumulated per strand as in
+// `lines_tangents()`.
+template <typename Grow>
+static void make_hair_strands(shape_data& hair, int num_strands,
+    const hair_params& params, float thickness, Grow&& grow_strand) {
+  auto curves       = min(params.curves, params.steps);
+  auto num_lines    = curves > 0 ? curves * 3 : params.steps;
+  auto num_vertices = num_lines + 1;
+  auto voffset      = (int)hair.positions.size();
+  auto loffset      = (int)hair.lines.size();
+  auto size         = voffset + num_strands * num_vertices;
+  hair.positions.resize(size);
+  hair.colors.resize(size);
+  hair.radius.resize(size, thickness);
+  hair.normals.resize(size);
+  hair.lines.resize(loffset + num_strands * num_lines);
+  auto       segment_length = params.lenght / params.steps;
+  const auto block_size     = 64;
+  auto       num_blocks     = (num_strands + block_size - 1) / block_size;
+  parallel_for(num_blocks, [&](int block) {
+    auto points = vector<vec3f>(curves > 0 ? params.steps + 1 : 0);
+    auto end    = min(num_strands, (block + 1) * block_size);
+    for (auto strand = block * block_size; strand < end; strand++) {
+      auto start = voffset + strand * num_vertices;
+      auto lines = hair.lines.data() + loffset + strand * num_lines;
+      if (curves > 0) {
+        grow_strand(points.data(), strand);
+        fit_hair_curves(hair.positions.data() + start, points.data(),
+            params.steps, curves);
+        for (auto s = 0; s <= num_lines; s++) {
+          auto color_mult        = (float)s / (float)num_lines;
+          hair.colors[start + s] = (1 - color_mult) * params.bottom +
+                                   color_mult * params.top;
+        }
+      } else {
+        grow_strand(hair.positions.data() + start, strand);
+        for (auto s = 0; s <= num_lines; s++) {
+          auto color_mult        = s * segment_length / params.lenght;
+          hair.colors[start + s] = (1 - color_mult) * params.bottom +
+                                   color_mult * params.top;
+        }
+      }
+      for (auto s = 0; s <= num_lines; s++) hair.normals[start + s] = zero3f;
+      for (auto s = 0; s < num_lines; s++) {
+        auto& p0      = hair.positions[start + s];
+        auto& p1      = hair.positions[start + s + 1];
+        auto  tangent = line_tangent(p0, p1) * line_length(p0, p1);
+        lines[s]      = {start + s, start + s + 1};
+        hair.normals[start + s] += tangent;
+        hair.normals[start + s + 1] += tangent;
+      }
+      for (auto s = 0; s <= num_lines; s++)
+        hair.normals[start + s] = normalize(hair.normals[start + s]);
     }
+  });
+}
+
+// Grows a hair strand from each root, appending the strands to `hair`.
+void make_hair_strands(shape_data& hair, const vector<vec3f>& positions,
+    const vector<vec3f>& normals, const hair_params& params,
+    float thickness = 0.0001f) {
+  make_hair_strands(hair, (int)positions.size(), params, thickness,
+      [&](vec3f* points, int strand) {
+        grow_hair_strand(points, positions[strand], normals[strand], params);
+      });
+}
+
+// Grows `guides` guide strands on a shape and interpolates a strand for each
+// root from its nearest guides, appending the strands to `hair`. Guides are
+// moved to the strand roots, weighted by `1 - d / d_max`, with `d_max` the
+// distance of the first guide not used, so that weights change continuously
+// across the surface. Strands are then pulled towards the nearest guide,
+// more towards the tip, by `clumping` scaled by a random amount per strand.
+static void make_guided_hair_strands(shape_data& hair, const shape_data& shape,
+    const shape_sampler& sampler, const vector<vec3f>& positions,
+    const hair_params& params) {
+  // guide strands, that are also corrected for collisions
+  auto guide_roots   = vector<vec3f>{};
+  auto guide_normals = vector<vec3f>{};
+  auto guide_uvs     = vector<vec2f>{};
+  sample_shape(guide_roots, guide_normals, guide_uvs, shape, sampler,
+      params.guides, 7673);
+  auto guide_params   = params;
+  guide_params.curves = 0;
+  auto guides         = shape_data{};
+  make_hair_strands(guides, guide_roots, guide_normals, guide_params);
+  if (params.collision_offset > 0 || params.collision_radius > 0)
+    collide_hair(guides, shape, params);
+
+  // search radius that holds a few times the guides needed on average
+  const auto num_nearest = 4;
+  auto       area        = 0.0f;
+  for (auto& t : sampler.triangles) {
+    area += triangle_area(
+        shape.positions[t.x], shape.positions[t.y], shape.positions[t.z]);
+  }
+  auto num_guides = (int)guide_roots.size();
+  auto radius     = sqrt(area * 3 * (num_nearest + 1) / (pif * num_guides));
+  auto grid       = make_flat_grid(guide_roots, radius);
+
+  // interpolate strands
+  auto num_points     = params.steps + 1;
+  auto nearest_guides = [&](vector<pair<float, int>>& nearest,
+                            vector<int>& neighbors, const vec3f& root) {
+    // grow the search radius if needed, then search all guides
+    for (auto scale = 1; scale <= 16; scale *= 2) {
+      find_neighbors(grid, neighbors, root, radius * scale);
+      if ((int)neighbors.size() > num_nearest) break;
+    }
+    if ((int)neighbors.size() <= num_nearest) {
+      neighbors.resize(num_guides);
+      for (auto guide = 0; guide < num_guides; guide++)
+        neighbors[guide] = guide;
+    }
+    nearest.clear();
+    for (auto guide : neighbors)
+      nearest.push_back({distance(root, guide_roots[guide]), guide});
+    auto count = min((int)nearest.size(), num_nearest + 1);
+    std::partial_sort(nearest.begin(), nearest.begin() + count, nearest.end());
+    nearest.resize(count);
+  };
+  make_hair_strands(hair, (int)positions.size(), params, 0.0001f,
+      [&](vec3f* points, int strand) {
+        thread_local static auto nearest   = vector<pair<float, int>>{};
+        thread_local static auto neighbors = vector<int>{};
+        auto&                    root      = positions[strand];
+        nearest_guides(nearest, neighbors, root);
+
+        // blend guides moved to the root
+        auto count        = (int)nearest.size();
+        auto max_distance = nearest.back().first;
+        auto total        = 0.0f;
+        for (auto s = 0; s < num_points; s++) points[s] = root;
+        for (auto idx = 0; idx < min(count, num_nearest); idx++) {
+          auto [dist, guide] = nearest[idx];
+          auto weight = max_distance > 0 ? 1 - dist / max_distance : 1.0f;
+          if (weight <= 0) continue;
+          auto guide_points = guides.positions.data() + guide * num_points;
+          for (auto s = 1; s < num_points; s++)
+            points[s] += (guide_points[s] - guide_points[0]) * weight;
+          total += weight;
+        }
+        auto closest = guides.positions.data() +
+                       nearest.front().second * num_points;
+        if (total == 0) {
+          for (auto s = 1; s < num_points; s++)
+            points[s] += closest[s] - closest[0];
+          total = 1;
+        }
+        for (auto s = 1; s < num_points; s++)
+          points[s] = root + (points[s] - root) / total;
+
+        // clump towards the nearest guide
+        if (params.clumping > 0) {
+          auto rng    = make_rng(params.guides, strand);
+          auto amount = params.clumping * (0.5f + 0.5f * rand1f(rng));
+          for (auto s = 1; s < num_points; s++) {
+            auto t    = amount * s / params.steps;
+            points[s] = points[s] * (1 - t) + closest[s] * t;
+          }
+        }
+      });
+}
+
+// Makes hair from strand roots, growing strands or interpolating them from
+// guides, sampled with the shape sampler of the roots, and correcting them
+// for collisions.
+static void make_hair(shape_data& hair, const shape_data& shape,
+    const shape_sampler& sampler, const vector<vec3f>& positions,
+    const vector<vec3f>& normals, const hair_params& params) {
+  if (params.guides > 0) {
+    // interpolated strands follow corrected guides, so only need to stay out
+    // of the body
+    make_guided_hair_strands(hair, shape, sampler, positions, params);
+    if (params.collision_offset > 0) {
+      auto body_params             = params;
+      body_params.collision_radius = 0;
+      collide_hair(hair, shape, body_params);
+    }
+  } else {
+    make_hair_strands(hair, positions, normals, params);
+    if (params.collision_offset > 0 || params.collision_radius > 0)
+      collide_hair(hair, shape, params);
   }
 }
 
-struct my_entry {
-  float* weight;
-  int    position;
+// Moves the vertices of a strand, but its root, at least `offset` outside a
+// shape, starting from the root. Vertices are searched near the surface
+// within the distance from the previous, corrected, vertex, since strands
+// start on the surface. Each correction also moves the rest of the strand.
+static void collide_strand(vec3f* points, int num, const shape_data& shape,
+    const bvh_data& bvh, float offset) {
+  auto shift = zero3f;
+  for (auto idx = 1; idx < num; idx++) {
+    points[idx] += shift;
+    auto max_distance = distance(points[idx], points[idx - 1]) + offset;
+    auto overlap      = overlap_bvh(bvh, shape, points[idx], max_distance);
+    if (!overlap.hit) continue;
+    auto position = eval_position(shape, overlap.element, overlap.uv);
+    auto normal   = eval_normal(shape, overlap.element, overlap.uv);
+    auto height   = dot(points[idx] - position, normal);
+    if (height >= offset) continue;
+    auto delta = normal * (offset - height);
+    points[idx] += delta;
+    shift += delta;
+  }
+}
+
+void collide_hair(
+    shape_data& hair, const shape_data& shape, const hair_params& params) {
+  // strands are runs of consecutive lines
+  auto starts = vector<int>{};
+  for (auto idx = 0; idx < (int)hair.lines.size(); idx++) {
+    if (idx == 0 || hair.lines[idx].x != hair.lines[idx - 1].y)
+      starts.push_back(hair.lines[idx].x);
+  }
+  auto num_strands = (int)starts.size();
+  if (num_strands == 0) return;
+  auto ends = vector<int>(num_strands);
+  for (auto strand = 0; strand < num_strands; strand++) {
+    ends[strand] = strand + 1 < num_strands ? starts[strand + 1]
+                                            : hair.lines.back().y + 1;
+  }
+
+  // strands against the shape, as triangles with no thickness
+  auto body = shape_data{};
+  auto bvh  = bvh_data{};
+  if (params.collision_offset > 0) {
+    auto qtriangles = quads_to_triangles(shape.quads);
+    body.positions  = shape.positions;
+    body.normals    = shape.normals;
+    body.triangles  = shape.triangles;
+    body.radius     = vector<float>(shape.positions.size(), 0);
+    body.triangles.insert(
+        body.triangles.end(), qtriangles.begin(), qtriangles.end());
+    bvh = make_bvh(body);
+    parallel_for(num_strands, [&](int strand) {
+      collide_strand(hair.positions.data() + starts[strand],
+          ends[strand] - starts[strand], body, bvh, params.collision_offset);
+    });
+  }
+
+  // strands against each other, pushing vertices of different strands apart
+  // from their positions in the previous iteration
+  if (params.collision_radius > 0) {
+    auto strand_ids = vector<int>(hair.positions.size(), -1);
+    for (auto strand = 0; strand < num_strands; strand++) {
+      for (auto idx = starts[strand]; idx < ends[strand]; idx++)
+        strand_ids[idx] = strand;
+    }
+    for (auto iteration = 0; iteration < params.collision_iterations;
+         iteration++) {
+      auto grid      = make_flat_grid(hair.positions, params.collision_radius);
+      auto positions = hair.positions;
+      parallel_for(num_strands, [&](int strand) {
+        auto neighbors = vector<int>{};
+        for (auto idx = starts[strand] + 1; idx < ends[strand]; idx++) {
+          find_neighbors(grid, neighbors, idx, params.collision_radius);
+          auto push = zero3f;
+          for (auto neighbor : neighbors) {
+            if (strand_ids[neighbor] == strand) continue;
+            auto direction = grid.positions[idx] - grid.positions[neighbor];
+            auto length    = yocto::length(direction);
+            if (length == 0) continue;
+            push += direction / length *
+                    (params.collision_radius - length) / 2;
+          }
+          positions[idx] += push;
+        }
+        if (params.collision_offset > 0) {
+          collide_strand(positions.data() + starts[strand],
+              ends[strand] - starts[strand], body, bvh,
+              params.collision_offset);
+        }
+      });
+      hair.positions = std::move(positions);
+    }
+  }
+
+  hair.normals = lines_tangents(hair.lines, hair.positions);
+}
 
-  inline bool operator<(const my_entry& b) const {
-    return (*weight) < (*b.weight);
+shape_sampler make_shape_sampler(const shape_data& shape) {
+  auto sampler      = shape_sampler{};
+  sampler.triangles = shape.triangles;
+  auto qtriangles   = quads_to_triangles(shape.quads);
+  sampler.triangles.insert(
+      sampler.triangles.end(), qtriangles.begin(), qtriangles.end());
+  auto areas = vector<float>(sampler.triangles.size());
+  for (auto idx = 0; idx < (int)areas.size(); idx++) {
+    auto& t    = sampler.triangles[idx];
+    areas[idx] = triangle_area(
+        shape.positions[t.x], shape.positions[t.y], shape.positions[t.z]);
   }
+  sampler.table = make_alias_table(areas);
+  return sampler;
+}
+
+void sample_shape(vector<vec3f>& positions, vector<vec3f>& normals,
+    vector<vec2f>& texcoords, const shape_data& shape,
+    const shape_sampler& sampler, int num, uint64_t seed) {
+  // chunks of samples with their own random streams
+  const auto chunk_size    = 4096;
+  auto       num_chunks    = (num + chunk_size - 1) / chunk_size;
+  auto       num_triangles = (int)sampler.triangles.size();
+  positions.resize(num);
+  normals.resize(num);
+  texcoords.resize(num);
+  if (num_triangles == 0) return;
+  parallel_for(num_chunks, [&](int chunk) {
+    auto rng = make_rng(seed, chunk);
+    auto end = min(num, (chunk + 1) * chunk_size);
+    for (auto idx = chunk * chunk_size; idx < end; idx++) {
+      auto element = sample_alias(
+          sampler.table, rand1i(rng, num_triangles), rand1f(rng));
+      auto  uv       = sample_triangle(rand2f(rng));
+      auto& t        = sampler.triangles[element];
+      positions[idx] = interpolate_triangle(
+          shape.positions[t.x], shape.positions[t.y], shape.positions[t.z], uv);
+      normals[idx] = normalize(interpolate_triangle(
+          shape.normals[t.x], shape.normals[t.y], shape.normals[t.z], uv));
+      texcoords[idx] = shape.texcoords.empty()
+                           ? uv
+                           : interpolate_triangle(shape.texcoords[t.x],
+                                 shape.texcoords[t.y], shape.texcoords[t.z],
+                                 uv);
+    }
+  });
+}
+
+void sample_shape(vector<vec3f>& positions, vector<vec3f>& normals,
+    vector<vec2f>& texcoords, const shape_data& shape, int num) {
+  sample_shape(
+      positions, normals, texcoords, shape, make_shape_sampler(shape), num);
+}
+
+// Sample elimination heap, a binary max heap of sample ids ordered by weight,
+// with ties broken by id, that tracks the heap position of each sample so
+// that weights can be decreased in place.
+struct elimination_heap {
+  vector<int>          heap      = {};
+  vector<int>          positions = {};
+  const vector<float>* weights   = nullptr;
 };
 
-bool compare_entry(const my_entry& a, const my_entry& b) {
-  return (*a.weight) < (*b.weight);
+// Heap ordering.
+static bool heap_before(const elimination_heap& heap, int a, int b) {
+  auto& weights = *heap.weights;
+  return weights[a] > weights[b] || (weights[a] == weights[b] && a < b);
 }
 
-void sample_elimination(vector<vec3f>& positions, vector<vec3f>& normals,
-    vector<vec2f>& texcoords, float cell_size, float influence_radius,
-    int desired_samples) {
-  // Create the grid
-  const float ALPHA = 8.0f;
-  std::cout << "creating the hashgrid" << std::endl;
-  auto grid = make_hash_grid(positions, cell_size);
-
-  // assign weight to each position
-  std::cout << "weight calculation" << std::endl;
-  vector<float> weight;
-  for (int i = 0; i < grid.positions.size(); i++) {
-    auto        current_point = grid.positions[i];
-    vector<int> neighbors;
-    find_neighbors(grid, neighbors, i, influence_radius);
-    auto sum = 0.0f;
-    for (auto& neighbor_idx : neighbors) {
-      auto neighbor = grid.positions[neighbor_idx];
-      sum += pow(
-          1.0f - distance(neighbor, current_point) / (2.0f * influence_radius),
-          ALPHA);
+// Moves the sample at heap position `pos` down to restore the heap order.
+static void sift_down(elimination_heap& heap, int pos) {
+  auto size = (int)heap.heap.size();
+  auto id   = heap.heap[pos];
+  while (true) {
+    auto child = 2 * pos + 1;
+    if (child >= size) break;
+    if (child + 1 < size &&
+        heap_before(heap, heap.heap[child + 1], heap.heap[child]))
+      child++;
+    if (!heap_before(heap, heap.heap[child], id)) break;
+    heap.heap[pos]                 = heap.heap[child];
+    heap.positions[heap.heap[pos]] = pos;
+    pos                            = child;
+  }
+  heap.heap[pos]     = id;
+  heap.positions[id] = pos;
+}
+
+// Removes the sample with the largest weight from the heap.
+static int pop_heap(elimination_heap& heap) {
+  auto id          = heap.heap.front();
+  heap.heap.front() = heap.heap.back();
+  heap.heap.pop_back();
+  heap.positions[id] = -1;
+  if (!heap.heap.empty()) sift_down(heap, 0);
+  return id;
+}
+
+neighbor_lists make_neighbor_lists(
+    const vector<vec3f>& positions, float cell_size, float radius) {
+  // query blocks of points in grid order, so that nearby queries read the
+  // same cells, in parallel and each in its own buffers
+  const auto block_size = 1024;
+  auto       num_points = (int)positions.size();
+  auto       num_blocks = (num_points + block_size - 1) / block_size;
+  auto       grid       = make_flat_grid(positions, cell_size);
+  auto       counts     = vector<int>(num_points, 0);
+  auto       indices    = vector<vector<int>>(num_blocks);
+  auto       distances  = vector<vector<float>>(num_blocks);
+  parallel_for(num_blocks, [&](int block) {
+    auto found = vector<int>{};
+    auto end   = min(num_points, (block + 1) * block_size);
+    for (auto sorted = block * block_size; sorted < end; sorted++) {
+      auto idx = grid.point_ids[sorted];
+      find_neighbors(grid, found, idx, radius);
+      counts[idx] = (int)found.size();
+      for (auto neighbor : found) {
+        indices[block].push_back(neighbor);
+        distances[block].push_back(
+            distance(positions[idx], positions[neighbor]));
+      }
     }
-    weight.push_back(sum);
-  }
-
-  // adding the entry to a list that will be converted in a heap
-  std::cout << "building the heap" << std::endl;
-  vector<my_entry> heap_weight_positions;
-  for (int i = 0; i < weight.size(); i++) {
-    struct my_entry e = {&weight[i], i};
-    heap_weight_positions.push_back(e);
-  }
-
-  // building the heap based on the weight
-
-  make_heap(heap_weight_positions.begin(), heap_weight_positions.end(),
-      compare_entry);
-  // while there are more samples than the required ones
-  auto counter = heap_weight_positions.size() - 1;
-  std::cout << "sample elimination" << std::endl;
-  while (counter > desired_samples) {
-    if ((counter % 100) == 0)
-      std::cout << counter << " / " << desired_samples << std::endl;
-    // get the root of the heap and remove it
-    auto element          = heap_weight_positions[0];
-    auto eliminated_point = grid.positions[(element.position)];
-    pop_heap(
-        heap_weight_positions.begin(), heap_weight_positions.begin() + counter);
-
-    // get the neighbors of the removed position
-    vector<int> neighbors;
-    find_neighbors(grid, neighbors, element.position, influence_radius);
-    for (auto neighbor_index : neighbors) {
-      // foreach neighbor, I remove the weight of the removed position from the
-      // total weight of the neighbor
-      auto neighbor = grid.positions[neighbor_index];
-      auto dist     = distance(neighbor, eliminated_point);
-      weight[neighbor_index] -= pow(
-          1.0f -
-              distance(neighbor, eliminated_point) / (2.0f * influence_radius),
-          ALPHA);
+  });
+
+  // scatter the blocks to the lists of each point
+  auto lists    = neighbor_lists{};
+  lists.offsets = vector<int>(num_points + 1, 0);
+  for (auto idx = 0; idx < num_points; idx++)
+    lists.offsets[idx + 1] = lists.offsets[idx] + counts[idx];
+  lists.indices.resize(lists.offsets.back());
+  lists.distances.resize(lists.offsets.back());
+  parallel_for(num_blocks, [&](int block) {
+    auto end    = min(num_points, (block + 1) * block_size);
+    auto cursor = 0;
+    for (auto sorted = block * block_size; sorted < end; sorted++) {
+      auto idx   = grid.point_ids[sorted];
+      auto start = lists.offsets[idx];
+      for (auto k = 0; k < counts[idx]; k++, cursor++) {
+        lists.indices[start + k]   = indices[block][cursor];
+        lists.distances[start + k] = distances[block][cursor];
+      }
     }
-    counter--;
-    // rebuild the heap
-    make_heap(heap_weight_positions.begin(),
-        heap_weight_positions.begin() + counter, compare_entry);
+    indices[block]   = {};
+    distances[block] = {};
+  });
+  return lists;
+}
+
+// Weighted sample elimination that also returns the removed samples in
+// order of removal.
+static vector<int> eliminate_samples(const vector<vec3f>& positions,
+    float cell_size, float influence_radius, int num, vector<int>& removed) {
+  auto num_points = (int)positions.size();
+  removed.clear();
+  if (num >= num_points) {
+    auto kept = vector<int>(num_points);
+    for (auto idx = 0; idx < num_points; idx++) kept[idx] = idx;
+    return kept;
   }
 
-  std::cout << "writing the solution" << std::endl;
-  // write the solution
+  // neighbor lists and the weights they contribute
+  auto lists    = make_neighbor_lists(positions, cell_size, influence_radius);
+  auto contribs = vector<float>(lists.distances.size());
+  parallel_for((int)contribs.size(), [&](int k) {
+    // (1 - d / 2r)^8 by repeated squaring
+    auto contrib = 1.0f - lists.distances[k] / (2.0f * influence_radius);
+    contrib *= contrib;
+    contrib *= contrib;
+    contribs[k] = contrib * contrib;
+  });
+  auto& offsets   = lists.offsets;
+  auto& neighbors = lists.indices;
+
+  // sample weights
+  auto weights = vector<float>(num_points, 0);
+  parallel_for(num_points, [&](int idx) {
+    for (auto k = offsets[idx]; k < offsets[idx + 1]; k++)
+      weights[idx] += contribs[k];
+  });
+
+  // remove the samples with the largest weight, updating their neighbors
+  auto heap    = elimination_heap{};
+  heap.weights = &weights;
+  heap.heap.resize(num_points);
+  heap.positions.resize(num_points);
+  for (auto idx = 0; idx < num_points; idx++) heap.heap[idx] = idx;
+  for (auto pos = num_points / 2 - 1; pos >= 0; pos--) sift_down(heap, pos);
+  for (auto pos = 0; pos < num_points; pos++)
+    heap.positions[heap.heap[pos]] = pos;
+  removed.reserve(num_points - num);
+  while ((int)heap.heap.size() > num) {
+    removed.push_back(pop_heap(heap));
+    for (auto k = offsets[removed.back()]; k < offsets[removed.back() + 1];
+         k++) {
+      auto neighbor = neighbors[k];
+      if (heap.positions[neighbor] < 0) continue;
+      weights[neighbor] -= contribs[k];
+      sift_down(heap, heap.positions[neighbor]);
+    }
+  }
 
-  vector<vec3f> new_pos;
-  vector<vec3f> new_norm;
-  vector<vec2f> new_texcoord;
-  for (int i = 0; i < desired_samples; i++) {
-    auto el = heap_weight_positions[i];
-    new_pos.push_back(positions[(el.position)]);
-    new_norm.push_back(normals[(el.position)]);
-    new_texcoord.push_back(texcoords[(el.position)]);
+  // kept samples in their original order
+  auto kept = heap.heap;
+  std::sort(kept.begin(), kept.end());
+  return kept;
+}
+
+vector<int> eliminate_samples(const vector<vec3f>& positions, float cell_size,
+    float influence_radius, int num) {
+  auto removed = vector<int>{};
+  return eliminate_samples(
+      positions, cell_size, influence_radius, num, removed);
+}
+
+vector<int> order_samples(const vector<vec3f>& positions, float cell_size,
+    float influence_radius, int num) {
+  // halve the samples at each stage, growing the radius to match the
+  // density on a surface, and order each stage by reverse removal
+  auto order  = vector<int>(positions.size());
+  auto next   = (int)positions.size();
+  auto subset = vector<int>(positions.size());
+  for (auto idx = 0; idx < (int)subset.size(); idx++) subset[idx] = idx;
+  auto stage_positions = positions;
+  auto removed         = vector<int>{};
+  auto num_samples     = (float)max(num, 1);  // keeps grid cells positive
+  while (subset.size() > 1) {
+    auto target = (int)subset.size() / 2;
+    auto scale  = sqrt(num_samples / (float)target);
+    auto kept   = eliminate_samples(stage_positions, cell_size * scale,
+        influence_radius * scale, target, removed);
+    for (auto idx : removed) order[--next] = subset[idx];
+    for (auto idx = 0; idx < (int)kept.size(); idx++) {
+      subset[idx]          = subset[kept[idx]];
+      stage_positions[idx] = stage_positions[kept[idx]];
+    }
+    subset.resize(kept.size());
+    stage_positions.resize(kept.size());
   }
-  for (int i = 0; i < desired_samples; i++) {
-    positions[i] = new_pos[i];
-    normals[i]   = new_norm[i];
-    texcoords[i] = new_texcoord[i];
+  if (!subset.empty()) order[--next] = subset.front();
+  return order;
+}
+
+void sample_elimination(vector<vec3f>& positions, vector<vec3f>& normals,
+    vector<vec2f>& texcoords, float cell_size, float influence_radius,
+    int desired_samples) {
+  auto kept = eliminate_samples(
+      positions, cell_size, influence_radius, desired_samples);
+  for (auto idx = 0; idx < (int)kept.size(); idx++) {
+    positions[idx] = positions[kept[idx]];
+    normals[idx]   = normals[kept[idx]];
+    texcoords[idx] = texcoords[kept[idx]];
   }
-  while (positions.size() > desired_samples) {
-    positions.pop_back();
-    normals.pop_back();
-    texcoords.pop_back();
+  positions.resize(kept.size());
+  normals.resize(kept.size());
+  texcoords.resize(kept.size());
+}
+
+void order_samples(vector<vec3f>& positions, vector<vec3f>& normals,
+    vector<vec2f>& texcoords, float cell_size, float influence_radius,
+    int num) {
+  auto order = order_samples(positions, cell_size, influence_radius, num);
+  auto ordered_positions = vector<vec3f>(order.size());
+  auto ordered_normals   = vector<vec3f>(order.size());
+  auto ordered_texcoords = vector<vec2f>(order.size());
+  for (auto idx = 0; idx < (int)order.size(); idx++) {
+    ordered_positions[idx] = positions[order[idx]];
+    ordered_normals[idx]   = normals[order[idx]];
+    ordered_texcoords[idx] = texcoords[order[idx]];
   }
+  positions = std::move(ordered_positions);
+  normals   = std::move(ordered_normals);
+  texcoords = std::move(ordered_texcoords);
 }
 
 ///////////////////////////// density for hair
-struct density_mapped_shape_data {
-  shape_data    shape;
-  vector<float> density_map;
+
+// Texture density sampler. Triangles are picked in proportion to their area
+// times their mean density, estimated at the texel centers they cover, with
+// an alias table. Points are placed uniformly in them and kept in proportion
+// to the density of their texel, by rejection against the largest density
+// the triangle covers. Texture coordinates wrap as in `eval_texture()`.
+struct texture_density_sampler {
+  vector<vec3i> triangles = {};
+  vector<float> bounds    = {};  // largest density of each triangle, or 0
+  alias_table   table     = {};
+  double        total     = 0;  // total weight, zero if nothing is covered
 };
 
-vector<float> sample_triangles_density_cdf(const vector<vec3i>& triangles,
-    const vector<vec3f>& positions, const vector<float>& density_map) {
-  auto cdf = vector<float>(triangles.size());
-  for (auto i = 0; i < cdf.size(); i++) {
-    auto& t = triangles[i];
-    auto  w = triangle_area(positions[t.x], positions[t.y], positions[t.z]);
+// Density of a texel, as the mean of its color, with wrapped coordinates.
+static float texel_density(const texture_data& texture, int i, int j) {
+  i          = ((i % texture.width) + texture.width) % texture.width;
+  j          = ((j % texture.height) + texture.height) % texture.height;
+  auto color = lookup_texture(texture, i, j);
+  return (color.x + color.y + color.z) / 3;
+}
 
-    cdf[i] = w * (abs((density_map[t.x] + density_map[t.z] + density_map[t.y]) /
-                      3)) +
-             (i != 0 ? cdf[i - 1] : 0);
-  }
-  auto sum = 0.0f;
-  for (auto& el : cdf) {
-    sum += el;
-  }
-  return cdf;
+// Barycentric coordinates of a point in a texture space triangle.
+static vec2f texture_barycentric(
+    const vec2f& p, const vec2f& t0, const vec2f& t1, const vec2f& t2) {
+  auto e1 = t1 - t0, e2 = t2 - t0, d = p - t0;
+  auto det = cross(e1, e2);
+  return {cross(d, e2) / det, cross(e1, d) / det};
 }
 
-void sample_shape_mapped(vector<vec3f>& positions, vector<vec3f>& normals,
-    vector<vec2f>& texcoords, const density_mapped_shape_data& shape, int num) {
-  auto triangles  = shape.shape.triangles;
-  auto qtriangles = quads_to_triangles(shape.shape.quads);
+static texture_density_sampler make_texture_density_sampler(
+    const shape_data& shape, const texture_data& texture) {
+  auto sampler      = texture_density_sampler{};
+  sampler.triangles = shape.triangles;
+  auto qtriangles   = quads_to_triangles(shape.quads);
+  sampler.triangles.insert(
+      sampler.triangles.end(), qtriangles.begin(), qtriangles.end());
+  auto num_triangles = (int)sampler.triangles.size();
+  sampler.bounds.assign(num_triangles, 0);
+
+  // largest density, the bound of triangles too large to scan all texels
+  auto max_density = 0.0f;
+  for (auto j = 0; j < texture.height; j++) {
+    for (auto i = 0; i < texture.width; i++)
+      max_density = max(max_density, texel_density(texture, i, j));
+  }
 
-  triangles.insert(triangles.end(), qtriangles.begin(), qtriangles.end());
+  // weight triangles by their area times their mean density
+  const auto max_texels = 4096;
+  auto       weights    = vector<float>(num_triangles, 0);
+  auto       scale = vec2f{(float)texture.width, (float)texture.height};
+  parallel_for(num_triangles, [&](int element) {
+    auto& t         = sampler.triangles[element];
+    auto  t0        = shape.texcoords[t.x] * scale;
+    auto  t1        = shape.texcoords[t.y] * scale;
+    auto  t2        = shape.texcoords[t.z] * scale;
+    auto  min_texel = vec2i{(int)floor(min(t0.x, min(t1.x, t2.x))),
+        (int)floor(min(t0.y, min(t1.y, t2.y)))};
+    auto  max_texel = vec2i{(int)floor(max(t0.x, max(t1.x, t2.x))),
+        (int)floor(max(t0.y, max(t1.y, t2.y)))};
+    // large triangles scan a subgrid of texels
+    auto extent = (double)(max_texel.x - min_texel.x + 1) *
+                  (double)(max_texel.y - min_texel.y + 1);
+    auto stride = extent > max_texels
+                      ? (int)ceil(sqrt(extent / max_texels))
+                      : 1;
+    auto sum = 0.0f, bound = 0.0f;
+    auto count = 0;
+    if (cross(t1 - t0, t2 - t0) != 0) {
+      for (auto j = min_texel.y; j <= max_texel.y; j += stride) {
+        for (auto i = min_texel.x; i <= max_texel.x; i += stride) {
+          auto density = texel_density(texture, i, j);
+          bound        = max(bound, density);
+          auto uv      = texture_barycentric(
+              vec2f{i + 0.5f, j + 0.5f}, t0, t1, t2);
+          if (uv.x < 0 || uv.y < 0 || uv.x + uv.y > 1) continue;
+          sum += density;
+          count += 1;
+        }
+      }
+    }
+    if (stride > 1) bound = max_density;
+
+    // triangles that cover no texel center use the density at their center
+    auto center = (t0 + t1 + t2) / 3;
+    auto mean   = count > 0 ? sum / count
+                            : texel_density(texture, (int)floor(center.x),
+                                  (int)floor(center.y));
+    auto area   = triangle_area(
+        shape.positions[t.x], shape.positions[t.y], shape.positions[t.z]);
+    weights[element]        = area * mean;
+    sampler.bounds[element] = weights[element] > 0 ? max(bound, mean) : 0;
+  });
+  for (auto weight : weights) sampler.total += weight;
+  sampler.table = make_alias_table(weights);
+  return sampler;
+}
 
-  auto cdf = sample_triangles_density_cdf(
-      triangles, shape.shape.positions, shape.density_map);
-  auto rng = make_rng((int)(1234));
+// Samples points on a shape with a texture density sampler. Rejection stops
+// after a few tries, keeping the last point, so that triangles whose texels
+// are mostly empty do not stall sampling. The sampler must have a positive
+// total weight.
+static void sample_texture_density(vector<vec3f>& positions,
+    vector<vec3f>& normals, vector<vec2f>& texcoords, const shape_data& shape,
+    const texture_data& texture, const texture_density_sampler& sampler,
+    int num) {
+  const auto max_tries     = 64;
+  auto       rng           = make_rng(1234);
+  auto       num_triangles = (int)sampler.triangles.size();
+  auto       scale = vec2f{(float)texture.width, (float)texture.height};
+  positions.resize(num);
+  normals.resize(num);
+  texcoords.resize(num);
   for (auto idx = 0; idx < num; idx++) {
-    auto [elem, uv] = sample_triangles(cdf, rand1f(rng), rand2f(rng));
-    auto q          = triangles[elem];
-    positions.push_back(interpolate_triangle(shape.shape.positions[q.x],
-        shape.shape.positions[q.y], shape.shape.positions[q.z], uv));
-    normals.push_back(normalize(interpolate_triangle(shape.shape.normals[q.x],
-        shape.shape.normals[q.y], shape.shape.normals[q.z], uv)));
-    if (!texcoords.empty()) {
-      texcoords.push_back(interpolate_triangle(shape.shape.texcoords[q.x],
-          shape.shape.texcoords[q.y], shape.shape.texcoords[q.z], uv));
-    } else {
-      texcoords.push_back(uv);
+    // zero weight triangles may be left in the table by rounding, so they
+    // are skipped
+    auto element = 0;
+    do {
+      element = sample_alias(
+          sampler.table, rand1i(rng, num_triangles), rand1f(rng));
+    } while (sampler.bounds[element] == 0);
+    auto& t        = sampler.triangles[element];
+    auto  uv       = zero2f;
+    auto  texcoord = zero2f;
+    for (auto tries = 0; tries < max_tries; tries++) {
+      uv       = sample_triangle(rand2f(rng));
+      texcoord = interpolate_triangle(shape.texcoords[t.x],
+          shape.texcoords[t.y], shape.texcoords[t.z], uv);
+      auto density = texel_density(texture, (int)floor(texcoord.x * scale.x),
+          (int)floor(texcoord.y * scale.y));
+      if (rand1f(rng) * sampler.bounds[element] < density) break;
     }
+    positions[idx] = interpolate_triangle(
+        shape.positions[t.x], shape.positions[t.y], shape.positions[t.z], uv);
+    normals[idx] = normalize(interpolate_triangle(
+        shape.normals[t.x], shape.normals[t.y], shape.normals[t.z], uv));
+    texcoords[idx] = texcoord;
   }
 }
 
 void make_dense_hair(scene_data& scene, shape_data& hair,
     const instance_data& object, const hair_params& params) {
-  auto          material       = scene.materials[object.material];
-  auto          shape          = scene.shapes[object.shape];
-  auto          segment_length = params.lenght / params.steps;
+  auto&         material = scene.materials[object.material];
+  auto&         shape    = scene.shapes[object.shape];
   vector<vec3f> positions;
   vector<vec3f> normals;
   vector<vec2f> texcoords;
-  vector<float> density_map;
-  for (int i = 0; i < shape.positions.size(); i++) {
-    auto texture_value = eval_texture(
-        scene, material.color_tex, shape.texcoords[i]);
-    auto value = (texture_value.x + texture_value.y + texture_value.z) / 3;
-    density_map.push_back(value);
-  }
-  sample_shape_mapped(
-      positions, normals, texcoords, {shape, density_map}, params.num);
-  for (int i = 0; i < params.num; i++) {
-    vector<vec3f> point_list;
-    vector<vec4f> colors;
-    vec3f         old_point;  // punto iniziale
-    vec3f         next_point = positions[i];
-    auto          norm       = normals[i];  // normale iniziale
-
-    for (int s = 0; s <= params.steps; s++) {
-      // pusho l'attuale punto
-      old_point = next_point;
-      point_list.push_back(next_point);
-      auto color_mult = s * segment_length / params.lenght;
-      colors.push_back(
-          (1 - color_mult) * params.bottom + color_mult * params.top);
-      // calcolo i dati per il prssimo punto
-      next_point = ray_point(ray3f{old_point, norm}, segment_length);
-      next_point += noise3(old_point * params.scale) * params.strength;
-      next_point.y -= params.gravity;
-      norm = normalize(next_point - old_point);
-    }
-    add_polyline(hair, point_list, colors);
+  auto          sampler = make_shape_sampler(shape);
+  auto          density = texture_density_sampler{};
+  if (material.color_tex != invalidid && !shape.texcoords.empty()) {
+    density = make_texture_density_sampler(
+        shape, scene.textures[material.color_tex]);
   }
-  hair.normals = compute_normals(hair);
+  // without a density, or with a zero one, sample by area
+  if (density.total > 0) {
+    sample_texture_density(positions, normals, texcoords, shape,
+        scene.textures[material.color_tex], density, params.num);
+  } else {
+    sample_shape(positions, normals, texcoords, shape, sampler, params.num);
+  }
+  make_hair(hair, shape, sampler, positions, normals, params);
 }
 
 ///////////////////////////// end density for hair
 
-void make_voro_terrain(shape_data& shape, const terrain_params& params) {
-  float u = 1;
-  float v = 1;
-  for (int i = 0; i < shape.positions.size(); i++) {
-    // position
-    auto& pos  = shape.positions[i];
-    auto& norm = shape.normals[i];
-    auto  molt = voronoise(pos * params.scale, u, v) * params.height;
-    pos += norm * molt;
-
-    // color
-    auto height = molt / params.height;
-    auto color  = params.top;
-    if (height < 0.3)
-      color = params.bottom;
-    else if (height < 0.6)
-      color = params.middle;
-    shape.colors.push_back(color);
+// Number of vertices processed together by the displacement engine. Blocks
+// are contiguous, so positions, normals and colors of a block stay in cache.
+const int displacement_block_size = 4096;
+
+// Evaluates heights over blocks of positions in parallel.
+template <typename Heights>
+void eval_heights_blocks(float* heights, const vec3f* positions, int num,
+    Heights&& eval_heights) {
+  auto num_blocks = (num + displacement_block_size - 1) /
+                    displacement_block_size;
+  parallel_for(num_blocks, [&](int block) {
+    auto start = block * displacement_block_size;
+    eval_heights(heights + start, positions + start,
+        min(displacement_block_size, num - start));
+  });
+}
+
+// Adaptively tessellates a shape before displacement. Edges are split at the
+// midpoint where the height there differs from the average of the endpoint
+// heights by more than `tolerance`, for up to `levels` rounds. The decision
+// is taken once per edge and shared by its faces, which are split in 2, 3 or
+// 4 triangles, so the mesh stays watertight. Edges and faces are processed in
+// parallel. Quads are converted to triangles.
+template <typename Heights>
+void tesselate_displacement(shape_data& shape, Heights&& eval_heights,
+    float tolerance, int levels) {
+  if (!shape.quads.empty()) {
+    shape.triangles = quads_to_triangles(shape.quads);
+    shape.quads     = {};
+  }
+  shape.colors   = {};
+  shape.tangents = {};
+  auto has_texcoords = !shape.texcoords.empty();
+  auto heights       = vector<float>(shape.positions.size());
+  eval_heights_blocks(heights.data(), shape.positions.data(),
+      (int)heights.size(), eval_heights);
+
+  for (auto level = 0; level < levels; level++) {
+    // edges
+    auto emap       = edge_map{};
+    auto face_edges = vector<vec3i>(shape.triangles.size());
+    for (auto face = 0; face < (int)shape.triangles.size(); face++) {
+      auto& t          = shape.triangles[face];
+      face_edges[face] = {insert_edge(emap, {t.x, t.y}),
+          insert_edge(emap, {t.y, t.z}), insert_edge(emap, {t.z, t.x})};
+    }
+    auto edges = get_edges(emap);
+
+    // compare midpoint heights with the interpolated ones
+    auto num_edges = (int)edges.size();
+    auto midpoints = vector<vec3f>(num_edges);
+    auto errors    = vector<float>(num_edges);
+    parallel_for(num_edges, [&](int edge) {
+      auto [a, b]     = edges[edge];
+      midpoints[edge] = (shape.positions[a] + shape.positions[b]) / 2;
+    });
+    eval_heights_blocks(
+        errors.data(), midpoints.data(), num_edges, eval_heights);
+
+    // new vertices
+    auto offset = (int)shape.positions.size();
+    auto split  = vector<int>(num_edges, -1);
+    auto num_splits = 0;
+    for (auto edge = 0; edge < num_edges; edge++) {
+      auto [a, b] = edges[edge];
+      if (fabs(errors[edge] - (heights[a] + heights[b]) / 2) > tolerance)
+        split[edge] = offset + num_splits++;
+    }
+    if (num_splits == 0) break;
+    shape.positions.resize(offset + num_splits);
+    shape.normals.resize(offset + num_splits);
+    if (has_texcoords) shape.texcoords.resize(offset + num_splits);
+    heights.resize(offset + num_splits);
+    parallel_for(num_edges, [&](int edge) {
+      auto vid = split[edge];
+      if (vid < 0) return;
+      auto [a, b]          = edges[edge];
+      shape.positions[vid] = midpoints[edge];
+      shape.normals[vid]   = normalize(shape.normals[a] + shape.normals[b]);
+      if (has_texcoords)
+        shape.texcoords[vid] = (shape.texcoords[a] + shape.texcoords[b]) / 2;
+      heights[vid] = errors[edge];
+    });
+
+    // split faces into as many triangles as their split edges plus one
+    auto num_faces = (int)shape.triangles.size();
+    auto starts    = vector<int>(num_faces + 1, 0);
+    for (auto face = 0; face < num_faces; face++) {
+      auto& e = face_edges[face];
+      starts[face + 1] = starts[face] + 1 + (split[e.x] >= 0) +
+                         (split[e.y] >= 0) + (split[e.z] >= 0);
+    }
+    auto triangles = vector<vec3i>(starts[num_faces]);
+    parallel_for(num_faces, [&](int face) {
+      auto& t   = shape.triangles[face];
+      auto& e   = face_edges[face];
+      auto  v   = array<int, 3>{t.x, t.y, t.z};
+      auto  m   = array<int, 3>{split[e.x], split[e.y], split[e.z]};
+      auto  out = triangles.data() + starts[face];
+      auto  num = starts[face + 1] - starts[face] - 1;
+      if (num == 0) {
+        out[0] = t;
+      } else if (num == 3) {
+        out[0] = {v[0], m[0], m[2]};
+        out[1] = {m[0], v[1], m[1]};
+        out[2] = {m[2], m[1], v[2]};
+        out[3] = {m[0], m[1], m[2]};
+      } else if (num == 1) {
+        auto k = m[0] >= 0 ? 0 : m[1] >= 0 ? 1 : 2;
+        out[0] = {v[k], m[k], v[(k + 2) % 3]};
+        out[1] = {m[k], v[(k + 1) % 3], v[(k + 2) % 3]};
+      } else {
+        auto k  = m[0] < 0 ? 0 : m[1] < 0 ? 1 : 2;
+        auto a  = v[k], b = v[(k + 1) % 3], c = v[(k + 2) % 3];
+        auto mb = m[(k + 1) % 3], mc = m[(k + 2) % 3];
+        out[0]  = {mb, c, mc};
+        out[1]  = {a, b, mb};
+        out[2]  = {a, mb, mc};
+      }
+    });
+    shape.triangles = std::move(triangles);
   }
+}
+
+// Displaces every vertex along its normal and sets its color to
+// `eval_color(height)`. Heights are computed a block at a time by
+// `eval_heights(heights, positions, num)`, so that noise can be evaluated in
+// batches. Blocks are processed in parallel. Each vertex only reads its own
+// data and colors are written into a presized array, so the output does not
+// depend on the number of threads. If `tolerance` is not zero, the shape is
+// first tessellated adaptively with `tesselate_displacement()`.
+template <typename Heights, typename Color>
+void displace_shape_blocks(shape_data& shape, Heights&& eval_heights,
+    Color&& eval_color, float tolerance = 0, int levels = 0) {
+  if (tolerance > 0)
+    tesselate_displacement(shape, eval_heights, tolerance, levels);
+  auto num_vertices = (int)shape.positions.size();
+  auto num_blocks   = (num_vertices + displacement_block_size - 1) /
+                    displacement_block_size;
+  shape.colors.resize(shape.positions.size());
+  parallel_for(num_blocks, [&shape, &eval_heights, &eval_color, num_vertices](
+                               int block) {
+    auto start   = block * displacement_block_size;
+    auto num     = min(displacement_block_size, num_vertices - start);
+    auto heights = array<float, displacement_block_size>{};
+    eval_heights(heights.data(), shape.positions.data() + start, num);
+    for (auto idx = start; idx < start + num; idx++) {
+      // position
+      auto molt = heights[idx - start];
+      shape.positions[idx] += shape.normals[idx] * molt;
+
+      // color
+      shape.colors[idx] = eval_color(molt);
+    }
+  });
   // normals
   shape.normals = compute_normals(shape);
 }
 
+// Same as above, with heights and their gradients with respect to position
+// computed by `eval_heights(heights, gradients, positions, num)`. Displaced
+// normals are obtained by tilting the normals against the tangential part of
+// the gradient, so no pass over the faces is needed.
+template <typename Heights, typename Color>
+void displace_shape_gradients(shape_data& shape, Heights&& eval_heights,
+    Color&& eval_color, float tolerance = 0, int levels = 0) {
+  if (tolerance > 0) {
+    tesselate_displacement(
+        shape,
+        [&eval_heights](float* heights, const vec3f* positions, int num) {
+          auto gradients = array<vec3f, displacement_block_size>{};
+          eval_heights(heights, gradients.data(), positions, num);
+        },
+        tolerance, levels);
+  }
+  auto num_vertices = (int)shape.positions.size();
+  auto num_blocks   = (num_vertices + displacement_block_size - 1) /
+                    displacement_block_size;
+  shape.colors.resize(shape.positions.size());
+  parallel_for(num_blocks, [&shape, &eval_heights, &eval_color, num_vertices](
+                               int block) {
+    auto start     = block * displacement_block_size;
+    auto num       = min(displacement_block_size, num_vertices - start);
+    auto heights   = array<float, displacement_block_size>{};
+    auto gradients = array<vec3f, displacement_block_size>{};
+    eval_heights(heights.data(), gradients.data(),
+        shape.positions.data() + start, num);
+    for (auto idx = start; idx < start + num; idx++) {
+      // position
+      auto molt     = heights[idx - start];
+      auto gradient = gradients[idx - start];
+      auto normal   = shape.normals[idx];
+      shape.positions[idx] += normal * molt;
+
+      // normal
+      shape.normals[idx] = normalize(
+          normal - (gradient - normal * dot(gradient, normal)));
+
+      // color
+      shape.colors[idx] = eval_color(molt);
+    }
+  });
+}
+
+// Same as above, with heights computed one vertex at a time by
+// `eval_height(position)`.
+template <typename Height, typename Color>
+void displace_shape(shape_data& shape, Height&& eval_height,
+    Color&& eval_color, float tolerance = 0, int levels = 0) {
+  displace_shape_blocks(
+      shape,
+      [&eval_height](float* heights, const vec3f* positions, int num) {
+        for (auto idx = 0; idx < num; idx++)
+          heights[idx] = eval_height(positions[idx]);
+      },
+      eval_color, tolerance, levels);
+}
+
+// Noise values at the vertices of a shape, either memory-mapped from a noise
+// cache or stored in `storage`.
+struct noise_values {
+  const float*  values  = nullptr;
+  vector<float> storage = {};
+  void*         mapped  = nullptr;
+  size_t        size    = 0;
+
+  noise_values() {}
+  noise_values(const noise_values&) = delete;
+  noise_values& operator=(const noise_values&) = delete;
+  ~noise_values() {
+#ifdef YOCTO_NOISE_MMAP
+    if (mapped) munmap(mapped, size);
+#endif
+  }
+};
+
+// Noise cache header, followed by `num` floats.
+struct noise_cache_header {
+  char     magic[8] = {'Y', 'N', 'O', 'I', 'S', 'E', '0', '1'};
+  uint64_t key      = 0;
+  uint64_t num      = 0;
+};
+
+// Noise cache key, a FNV-1a hash of the noise name and parameters and of the
+// shape positions.
+static uint64_t make_noise_cache_key(const shape_data& shape,
+    const string& noise, const vector<float>& params) {
+  auto hash = (uint64_t)14695981039346656037ull;
+  for (auto c : noise) hash = (hash ^ (unsigned char)c) * 1099511628211ull;
+  auto hash_words = [&hash](const void* data, size_t size) {
+    auto words = (const uint32_t*)data;
+    for (auto idx = (size_t)0; idx < size / 4; idx++)
+      hash = (hash ^ words[idx]) * 1099511628211ull;
+  };
+  hash_words(params.data(), params.size() * sizeof(float));
+  hash_words(shape.positions.data(), shape.positions.size() * sizeof(vec3f));
+  return hash;
+}
+
+// Maps a noise cache file. Returns false if the file is missing or does not
+// match the key.
+static bool load_noise_cache(
+    const string& filename, uint64_t key, size_t num, noise_values& values) {
+  auto size = sizeof(noise_cache_header) + num * sizeof(float);
+#ifdef YOCTO_NOISE_MMAP
+  auto fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat info;
+  if (fstat(fd, &info) != 0 || (size_t)info.st_size != size) {
+    close(fd);
+    return false;
+  }
+  auto mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) return false;
+  auto header = (const noise_cache_header*)mapped;
+  if (memcmp(header->magic, noise_cache_header{}.magic, 8) != 0 ||
+      header->key != key || header->num != num) {
+    munmap(mapped, size);
+    return false;
+  }
+  values.mapped = mapped;
+  values.size   = size;
+  values.values = (const float*)((const char*)mapped +
+                                 sizeof(noise_cache_header));
+  return true;
+#else
+  auto fs = fopen_utf8(filename, "rb");
+  if (!fs) return false;
+  auto header = noise_cache_header{};
+  auto ok     = fread(&header, sizeof(header), 1, fs) == 1 &&
+            memcmp(header.magic, noise_cache_header{}.magic, 8) == 0 &&
+            header.key == key && header.num == num;
+  if (ok) {
+    values.storage.resize(num);
+    ok = fread(values.storage.data(), sizeof(float), num, fs) == num;
+  }
+  fclose(fs);
+  if (!ok) return false;
+  values.values = values.storage.data();
+  return true;
+#endif
+}
+
+// Saves a noise cache file. The file is written under a temporary name and
+// then renamed, so concurrent runs never map a partial file.
+static bool save_noise_cache(
+    const string& filename, uint64_t key, const vector<float>& values) {
+  auto tempname = filename + '.' +
+                  std::to_string(std::random_device{}()) + ".tmp";
+  auto fs = fopen_utf8(tempname, "wb");
+  if (!fs) return false;
+  auto header = noise_cache_header{};
+  header.key  = key;
+  header.num  = values.size();
+  auto ok     = fwrite(&header, sizeof(header), 1, fs) == 1 &&
+            fwrite(values.data(), sizeof(float), values.size(), fs) ==
+                values.size();
+  ok = fclose(fs) == 0 && ok;
+  if (ok) ok = std::rename(tempname.c_str(), filename.c_str()) == 0;
+  if (!ok) std::remove(tempname.c_str());
+  return ok;
+}
+
+// Gets the noise values at the shape vertices from the cache in `dirname`.
+// On a miss, values are computed with `eval_noise(values, positions, num)`
+// and added to the cache. Cache errors only cause values to be recomputed.
+template <typename Noise>
+static void cached_noise(noise_values& values, const shape_data& shape,
+    const string& dirname, const string& noise, const vector<float>& params,
+    Noise&& eval_noise) {
+  auto num      = shape.positions.size();
+  auto key      = make_noise_cache_key(shape, noise, params);
+  auto keyname  = array<char, 17>{};
+  snprintf(keyname.data(), keyname.size(), "%016llx", (unsigned long long)key);
+  auto filename = path_join(dirname, noise + "_" + keyname.data() + ".bin");
+  if (load_noise_cache(filename, key, num, values)) return;
+  values.storage.resize(num);
+  eval_heights_blocks(
+      values.storage.data(), shape.positions.data(), (int)num, eval_noise);
+  values.values = values.storage.data();
+  auto error    = string{};
+  if (make_directory(dirname, error))
+    save_noise_cache(filename, key, values.storage);
+}
+
+void make_voro_terrain(shape_data& shape, const terrain_params& params) {
+  float u = 1;
+  float v = 1;
+  displace_shape(
+      shape,
+      [&](const vec3f& pos) {
+        return fast_voronoise(pos * params.scale, u, v) * params.height;
+      },
+      [&](float molt) {
+        auto height = molt / params.height;
+        auto color  = params.top;
+        if (height < 0.3)
+          color = params.bottom;
+        else if (height < 0.6)
+          color = params.middle;
+        return color;
+      },
+      params.adaptive_tolerance, params.adaptive_levels);
+}
+
+// Terrain heights from the ridge noise, decreasing away from the center.
+static void terrain_heights(float* heights, const float* noise,
+    const vec3f* positions, int num, const terrain_params& params) {
+  for (auto idx = 0; idx < num; idx++)
+    heights[idx] = noise[idx] * params.height *
+                   (1 - length(positions[idx] - params.center) / params.size);
+}
+
+// Terrain heights, a ridge noise that decreases away from the center.
+static void terrain_heights(float* heights, const vec3f* positions, int num,
+    const terrain_params& params) {
+  ridge(heights, positions, num, params.scale, params.octaves);
+  terrain_heights(heights, heights, positions, num, params);
+}
+
+// Terrain color ramp.
+static vec4f terrain_color(float molt, const terrain_params& params) {
+  auto height = molt / params.height;
+  auto color  = params.top;
+  if (height < 0.3)
+    color = params.bottom;
+  else if (height < 0.6)
+    color = params.middle;
+  return color;
+}
+
 void make_terrain(shape_data& shape, const terrain_params& params) {
-  for (int i = 0; i < shape.positions.size(); i++) {
-    // position
-    auto& pos  = shape.positions[i];
-    auto& norm = shape.normals[i];
-    auto  molt = ridge(pos * params.scale, params.octaves) * params.height *
-                (1 - length(pos - params.center) / params.size);
-    pos += norm * molt;
-
-    // color
-    auto height = molt / params.height;
-    auto color  = params.top;
-    if (height < 0.3)
-      color = params.bottom;
-    else if (height < 0.6)
-      color = params.middle;
-    shape.colors.push_back(color);
+  if (params.analytic_normals) {
+    displace_shape_gradients(
+        shape,
+        [&](float* heights, vec3f* gradients, const vec3f* positions,
+            int num) {
+          ridge(heights, gradients, positions, num, params.scale,
+              params.octaves);
+          for (auto idx = 0; idx < num; idx++) {
+            auto offset   = positions[idx] - params.center;
+            auto distance = length(offset);
+            auto falloff  = 1 - distance / params.size;
+            auto dfalloff = distance > 0 ? -offset / (distance * params.size)
+                                         : zero3f;
+            gradients[idx] = (gradients[idx] * falloff +
+                                 heights[idx] * dfalloff) *
+                             params.height;
+            heights[idx] = heights[idx] * params.height * falloff;
+          }
+        },
+        [&](float molt) { return terrain_color(molt, params); },
+        params.adaptive_tolerance, params.adaptive_levels);
+    return;
+  }
+  if (params.cache != "" && params.adaptive_tolerance == 0) {
+    auto noise = noise_values{};
+    cached_noise(noise, shape, params.cache, "ridge",
+        {params.scale, (float)params.octaves},
+        [&](float* values, const vec3f* positions, int num) {
+          ridge(values, positions, num, params.scale, params.octaves);
+        });
+    displace_shape_blocks(
+        shape,
+        [&](float* heights, const vec3f* positions, int num) {
+          auto start = positions - shape.positions.data();
+          terrain_heights(
+              heights, noise.values + start, positions, num, params);
+        },
+        [&](float molt) { return terrain_color(molt, params); });
+    return;
+  }
+  displace_shape_blocks(
+      shape,
+      [&](float* heights, const vec3f* positions, int num) {
+        terrain_heights(heights, positions, num, params);
+      },
+      [&](float molt) { return terrain_color(molt, params); },
+      params.adaptive_tolerance, params.adaptive_levels);
+}
+
+// Makes a tile of a tiled terrain with `steps` quads per side, evaluating the
+// terrain heights with `octaves` octaves. Tiles share a global grid, so that
+// border vertices are computed at the same positions by adjacent tiles.
+// Normals are computed on the tile grid extended by a halo of one vertex, that
+// gives border vertices the same neighbors they have in adjacent tiles.
+static shape_data make_terrain_tile(const terrain_params& params,
+    const terrain_tile_params& tparams, const vec2i& tile, int steps,
+    int octaves) {
+  auto spacing = tparams.tile_size / steps;
+  auto corner  = vec2f{params.center.x, params.center.z} +
+                vec2f{-(float)tparams.tiles.x, (float)tparams.tiles.y} *
+                    tparams.tile_size / 2;
+  auto tile_params    = params;
+  tile_params.octaves = octaves;
+
+  // heights over the tile and its halo
+  auto halo_size = steps + 3;
+  auto positions = vector<vec3f>(halo_size * halo_size);
+  auto heights   = vector<float>(halo_size * halo_size);
+  auto normals   = vector<vec3f>(halo_size * halo_size);
+  for (auto j = 0; j < halo_size; j++) {
+    for (auto i = 0; i < halo_size; i++) {
+      auto gi = tile.x * steps + i - 1;
+      auto gj = tile.y * steps + j - 1;
+      positions[j * halo_size + i] = {
+          corner.x + gi * spacing, 0, corner.y - gj * spacing};
+    }
+  }
+  terrain_heights(
+      heights.data(), positions.data(), (int)positions.size(), tile_params);
+  for (auto idx = 0; idx < (int)positions.size(); idx++)
+    positions[idx].y += heights[idx];
+  quads_normals(normals,
+      make_recty({steps + 2, steps + 2}, {1, 1}).quads, positions);
+
+  // crop the halo
+  auto shape = make_recty({steps, steps}, {1, 1});
+  shape.colors.resize(shape.positions.size());
+  for (auto j = 0; j <= steps; j++) {
+    for (auto i = 0; i <= steps; i++) {
+      auto vid             = j * (steps + 1) + i;
+      auto hid             = (j + 1) * halo_size + i + 1;
+      shape.positions[vid] = positions[hid];
+      shape.normals[vid]   = normals[hid];
+      shape.colors[vid]    = terrain_color(heights[hid], params);
+    }
+  }
+  return shape;
+}
+
+bool make_terrain_tiles(const string& dirname, const terrain_params& params,
+    const terrain_tile_params& tparams, string& error) {
+  if (!make_directory(dirname, error)) return false;
+
+  // each worker keeps a single tile in memory
+  auto num_tiles   = tparams.tiles.x * tparams.tiles.y;
+  auto num_workers = tparams.in_flight > 0
+                         ? tparams.in_flight
+                         : (int)std::thread::hardware_concurrency();
+  num_workers      = max(1, min(num_workers, num_tiles));
+  auto next_tile   = std::atomic<int>{0};
+  auto has_error   = std::atomic<bool>{false};
+  auto error_mutex = std::mutex{};
+  auto workers     = vector<std::future<void>>{};
+  for (auto worker = 0; worker < num_workers; worker++) {
+    workers.emplace_back(std::async(std::launch::async, [&]() {
+      while (!has_error) {
+        auto tile_id = next_tile.fetch_add(1);
+        if (tile_id >= num_tiles) break;
+        auto tile = vec2i{
+            tile_id % tparams.tiles.x, tile_id / tparams.tiles.x};
+        auto shape = make_terrain_tile(
+            params, tparams, tile, tparams.tile_steps, params.octaves);
+
+        // save
+        auto ply = ply_model{};
+        add_positions(ply, shape.positions);
+        add_normals(ply, shape.normals);
+        add_texcoords(ply, shape.texcoords, true);
+        add_colors(ply, shape.colors);
+        add_quads(ply, shape.quads);
+        auto name = "tile_" + std::to_string(tile.x) + "_" +
+                    std::to_string(tile.y) + ".ply";
+        auto tile_error = string{};
+        if (!save_ply(path_join(dirname, name), ply, tile_error)) {
+          auto lock = std::lock_guard{error_mutex};
+          if (!has_error) error = tile_error;
+          has_error = true;
+        }
+      }
+    }));
+  }
+  for (auto& worker : workers) worker.get();
+  return !has_error;
+}
+
+// Adds a skirt below the border of a tile grid with `steps` quads per side.
+// Skirts hide the cracks between adjacent tiles at different levels of detail.
+static void add_terrain_skirt(shape_data& shape, int steps, float depth) {
+  // border loop, with the tile on the left when seen from above
+  auto border = vector<int>{};
+  for (auto i = 0; i < steps; i++) border.push_back(i);
+  for (auto j = 0; j < steps; j++) border.push_back(j * (steps + 1) + steps);
+  for (auto i = steps; i > 0; i--) border.push_back(steps * (steps + 1) + i);
+  for (auto j = steps; j > 0; j--) border.push_back(j * (steps + 1));
+
+  auto offset = (int)shape.positions.size();
+  for (auto vid : border) {
+    shape.positions.push_back(shape.positions[vid] - vec3f{0, depth, 0});
+    shape.normals.push_back(shape.normals[vid]);
+    shape.texcoords.push_back(shape.texcoords[vid]);
+    shape.colors.push_back(shape.colors[vid]);
+  }
+  auto num = (int)border.size();
+  for (auto idx = 0; idx < num; idx++) {
+    auto next = (idx + 1) % num;
+    shape.quads.push_back(
+        {border[next], border[idx], offset + idx, offset + next});
+  }
+}
+
+vector<terrain_lod> make_terrain_lods(const terrain_params& params,
+    const terrain_tile_params& tparams, const terrain_lod_params& lparams) {
+  auto num_tiles = tparams.tiles.x * tparams.tiles.y;
+  auto lods      = vector<terrain_lod>(num_tiles);
+  for (auto tile_id = 0; tile_id < num_tiles; tile_id++) {
+    auto& lod = lods[tile_id];
+    lod.tile  = vec2i{tile_id % tparams.tiles.x, tile_id / tparams.tiles.x};
+    lod.levels.resize(lparams.levels);
+  }
+  // coarse levels halve the grid only while it stays even, so their vertices
+  // line up with the ones of the finest level
+  auto level_steps = vector<int>(lparams.levels, tparams.tile_steps);
+  for (auto level = 1; level < lparams.levels; level++) {
+    auto steps         = level_steps[level - 1];
+    level_steps[level] = (steps % 2 == 0) ? steps / 2 : steps;
+  }
+  parallel_for(num_tiles * lparams.levels, [&](int idx) {
+    auto  tile_id = idx / lparams.levels, level = idx % lparams.levels;
+    auto& lod     = lods[tile_id];
+    // coarse levels drop the octaves they cannot resolve
+    auto  steps   = level_steps[level];
+    auto  octaves = max(1, params.octaves - level);
+    auto& shape   = lod.levels[level];
+    shape = make_terrain_tile(params, tparams, lod.tile, steps, octaves);
+    if (level == 0) {
+      for (auto& position : shape.positions)
+        lod.bounds = merge(lod.bounds, position);
+    }
+    add_terrain_skirt(shape, steps, lparams.skirt);
+  });
+  return lods;
+}
+
+int select_terrain_lod(const terrain_lod& lod, const vec3f& camera,
+    const terrain_lod_params& lparams) {
+  auto closest  = max(lod.bounds.min, min(camera, lod.bounds.max));
+  auto distance = length(camera - closest);
+  auto level    = 0;
+  while (level + 1 < (int)lod.levels.size() &&
+         distance >= lparams.distance * (float)(1 << level))
+    level++;
+  return level;
+}
+
+void add_terrain_lods(scene_data& scene, const vector<terrain_lod>& lods,
+    const vec3f& camera, const terrain_lod_params& lparams) {
+  auto material = (int)scene.materials.size();
+  scene.materials.push_back({});
+  scene.materials.back().color = {1, 1, 1};
+  if (!scene.material_names.empty()) scene.material_names.push_back("terrain");
+  for (auto& lod : lods) {
+    auto level = select_terrain_lod(lod, camera, lparams);
+    auto name  = "terrain_" + std::to_string(lod.tile.x) + "_" +
+                std::to_string(lod.tile.y);
+    scene.shapes.push_back(lod.levels[level]);
+    scene.instances.push_back({identity3x4f, (int)scene.shapes.size() - 1,
+        material});
+    if (!scene.shape_names.empty()) scene.shape_names.push_back(name);
+    if (!scene.instance_names.empty()) scene.instance_names.push_back(name);
   }
-  // normals
-  shape.normals = compute_normals(shape);
 }
 
 void make_voro_displacement(
     shape_data& shape, const displacement_params& params, float u, float v) {
-  for (int i = 0; i < shape.positions.size(); i++) {
-    // position
-    auto& pos  = shape.positions[i];
-    auto& norm = shape.normals[i];
-    auto  molt = voronoise(pos * params.scale, u, v) * params.height;
-    pos += norm * molt;
-
-    // color
-    auto height = molt / params.height;
-    auto color  = height * params.top + (1 - height) * params.bottom;
-    shape.colors.push_back(color);
-  }
-  // normals
-  shape.normals = compute_normals(shape);
+  displace_shape(
+      shape,
+      [&](const vec3f& pos) {
+        return fast_voronoise(pos * params.scale, u, v) * params.height;
+      },
+      [&](float molt) {
+        auto height = molt / params.height;
+        return height * params.top + (1 - height) * params.bottom;
+      },
+      params.adaptive_tolerance, params.adaptive_levels);
 }
 
 void make_smooth_voro_displacement(
     shape_data& shape, const displacement_params& params) {
-  float u = 1;
-  float v = 1;
-  for (int i = 0; i < shape.positions.size(); i++) {
-    // position
-    auto& pos  = shape.positions[i];
-    auto& norm = shape.normals[i];
-    auto  molt = smoothVoronoi(pos * params.scale) * params.height;
-    pos += norm * molt;
-
-    // color
-    auto height = molt / params.height;
-    auto color  = height * params.top + (1 - height) * params.bottom;
-    shape.colors.push_back(color);
-  }
-  // normals
-  shape.normals = compute_normals(shape);
+  displace_shape(
+      shape,
+      [&](const vec3f& pos) {
+        return smoothVoronoi(pos * params.scale) * params.height;
+      },
+      [&](float molt) {
+        auto height = molt / params.height;
+        return height * params.top + (1 - height) * params.bottom;
+      },
+      params.adaptive_tolerance, params.adaptive_levels);
 }
 
 void make_cell_voro_displacement(
     shape_data& shape, const displacement_params& params) {
-  for (int i = 0; i < shape.positions.size(); i++) {
-    // position
-    auto& pos  = shape.positions[i];
-    auto& norm = shape.normals[i];
-    auto  molt = getBorder(pos * params.scale) * params.height;
-    pos += norm * molt;
-
-    // color
-    auto height = molt / params.height;
-    auto color  = height * params.top + (1 - height) * params.bottom;
-    shape.colors.push_back(vec4f{molt, molt, molt, 1});
-  }
-  // normals
-  shape.normals = compute_normals(shape);
+  displace_shape_blocks(
+      shape,
+      [&](float* heights, const vec3f* positions, int num) {
+        auto samples = array<cell_noise_sample, displacement_block_size>{};
+        cell_noise(samples.data(), positions, num, params.scale);
+        for (auto idx = 0; idx < num; idx++) {
+          auto d       = samples[idx].border;
+          heights[idx] = d * smoothstep(0.0f, 0.05f, d) * params.height;
+        }
+      },
+      [&](float molt) { return vec4f{molt, molt, molt, 1}; },
+      params.adaptive_tolerance, params.adaptive_levels);
 }
 
 // I know, it's a ctrl+c ctrl+v, but i wanted to experiment how different
@@ -554,105 +2596,122 @@ void make_cell_voro_displacement(
 void make_world(shape_data& shape, const displacement_params& params) {
   float u = 1;
   float v = 1;
-  for (int i = 0; i < shape.positions.size(); i++) {
-    // position
-    auto& pos  = shape.positions[i];
-    auto& norm = shape.normals[i];
-    auto  molt = (voronoise(pos * params.scale, u, v) +
-                    fbm(pos * params.scale, 8) + ridge(pos * params.scale, 8)) *
-                params.height;
-    pos += norm * molt;
-
-    // color
-    auto height = molt / params.height;
-    auto color  = height * params.top + (1 - height) * params.bottom;
-    shape.colors.push_back(color);
-  }
-  // normals
-  shape.normals = compute_normals(shape);
+  displace_shape_blocks(
+      shape,
+      [&](float* heights, const vec3f* positions, int num) {
+        auto fbms   = array<float, displacement_block_size>{};
+        auto ridges = array<float, displacement_block_size>{};
+        fbm(fbms.data(), positions, num, params.scale, 8);
+        ridge(ridges.data(), positions, num, params.scale, 8);
+        for (auto idx = 0; idx < num; idx++) {
+          auto voro    = fast_voronoise(positions[idx] * params.scale, u, v);
+          heights[idx] = (voro + fbms[idx] + ridges[idx]) * params.height;
+        }
+      },
+      [&](float molt) {
+        auto height = molt / params.height;
+        return height * params.top + (1 - height) * params.bottom;
+      },
+      params.adaptive_tolerance, params.adaptive_levels);
 }
 
 void make_displacement(shape_data& shape, const displacement_params& params) {
-  for (int i = 0; i < shape.positions.size(); i++) {
-    // position
-    auto& pos  = shape.positions[i];
-    auto& norm = shape.normals[i];
-    auto  molt = turbulence(pos * params.scale, params.octaves) * params.height;
-    pos += norm * molt;
-
-    // color
-    auto height = molt / params.height;
-    auto color  = height * params.top + (1 - height) * params.bottom;
-    shape.colors.push_back(color);
+  if (params.analytic_normals) {
+    displace_shape_gradients(
+        shape,
+        [&](float* heights, vec3f* gradients, const vec3f* positions,
+            int num) {
+          turbulence(heights, gradients, positions, num, params.scale,
+              params.octaves);
+          for (auto idx = 0; idx < num; idx++) {
+            heights[idx] *= params.height;
+            gradients[idx] *= params.height;
+          }
+        },
+        [&](float molt) {
+          auto height = molt / params.height;
+          return height * params.top + (1 - height) * params.bottom;
+        },
+        params.adaptive_tolerance, params.adaptive_levels);
+    return;
   }
-  // normals
-  shape.normals = compute_normals(shape);
+  if (params.cache != "" && params.adaptive_tolerance == 0) {
+    auto noise = noise_values{};
+    cached_noise(noise, shape, params.cache, "turbulence",
+        {params.scale, (float)params.octaves},
+        [&](float* values, const vec3f* positions, int num) {
+          turbulence(values, positions, num, params.scale, params.octaves);
+        });
+    displace_shape_blocks(
+        shape,
+        [&](float* heights, const vec3f* positions, int num) {
+          auto start = positions - shape.positions.data();
+          for (auto idx = 0; idx < num; idx++)
+            heights[idx] = noise.values[start + idx] * params.height;
+        },
+        [&](float molt) {
+          auto height = molt / params.height;
+          return height * params.top + (1 - height) * params.bottom;
+        });
+    return;
+  }
+  displace_shape_blocks(
+      shape,
+      [&](float* heights, const vec3f* positions, int num) {
+        turbulence(heights, positions, num, params.scale, params.octaves);
+        for (auto idx = 0; idx < num; idx++) heights[idx] *= params.height;
+      },
+      [&](float molt) {
+        auto height = molt / params.height;
+        return height * params.top + (1 - height) * params.bottom;
+      },
+      params.adaptive_tolerance, params.adaptive_levels);
+}
+
+void make_noise_displacement(shape_data& shape, const noise_graph& graph,
+    const displacement_params& params) {
+  auto program = compile_noise_graph(graph);
+  displace_shape_blocks(
+      shape,
+      [&](float* heights, const vec3f* positions, int num) {
+        eval_noise_program(heights, program, positions, num);
+        for (auto idx = 0; idx < num; idx++) heights[idx] *= params.height;
+      },
+      [&](float molt) {
+        auto height = molt / params.height;
+        return height * params.top + (1 - height) * params.bottom;
+      },
+      params.adaptive_tolerance, params.adaptive_levels);
 }
 
 void make_hair(
     shape_data& hair, const shape_data& shape, const hair_params& params) {
-  auto          segment_length = params.lenght / params.steps;
   vector<vec3f> positions;
   vector<vec3f> normals;
   vector<vec2f> texcoords;
-  sample_shape(positions, normals, texcoords, shape, params.num);
-  for (int i = 0; i < params.num; i++) {
-    vector<vec3f> point_list;
-    vector<vec4f> colors;
-    vec3f         old_point;  // punto iniziale
-    vec3f         next_point = positions[i];
-    auto          norm       = normals[i];  // normale iniziale
-
-    for (int s = 0; s <= params.steps; s++) {
-      // pusho l'attuale punto
-      old_point = next_point;
-      point_list.push_back(next_point);
-      auto color_mult = s * segment_length / params.lenght;
-      colors.push_back(
-          (1 - color_mult) * params.bottom + color_mult * params.top);
-      // calcolo i dati per il prssimo punto
-      next_point = ray_point(ray3f{old_point, norm}, segment_length);
-      next_point += noise3(old_point * params.scale) * params.strength;
-      next_point.y -= params.gravity;
-      norm = normalize(next_point - old_point);
-    }
-    add_polyline(hair, point_list, colors);
-  }
-  hair.normals = compute_normals(hair);
+  auto          sampler = make_shape_sampler(shape);
+  sample_shape(positions, normals, texcoords, shape, sampler, params.num);
+  make_hair(hair, shape, sampler, positions, normals, params);
 }
 
 void make_hair_sample_elimination(
     shape_data& hair, const shape_data& shape, const hair_params& params) {
-  auto          segment_length = params.lenght / params.steps;
   vector<vec3f> positions;
   vector<vec3f> normals;
   vector<vec2f> texcoords;
-  sample_shape(positions, normals, texcoords, shape, params.num * 5);
-  sample_elimination(positions, normals, texcoords, params.cell_size,
-      params.influence_radius, params.num);
-  for (int i = 0; i < params.num; i++) {
-    vector<vec3f> point_list;
-    vector<vec4f> colors;
-    vec3f         old_point;  // punto iniziale
-    vec3f         next_point = positions[i];
-    auto          norm       = normals[i];  // normale iniziale
-
-    for (int s = 0; s <= params.steps; s++) {
-      // pusho l'attuale punto
-      old_point = next_point;
-      point_list.push_back(next_point);
-      auto color_mult = s * segment_length / params.lenght;
-      colors.push_back(
-          (1 - color_mult) * params.bottom + color_mult * params.top);
-      // calcolo i dati per il prssimo punto
-      next_point = ray_point(ray3f{old_point, norm}, segment_length);
-      next_point += noise3(old_point * params.scale) * params.strength;
-      next_point.y -= params.gravity;
-      norm = normalize(next_point - old_point);
-    }
-    add_polyline(hair, point_list, colors);
+  auto          sampler = make_shape_sampler(shape);
+  sample_shape(positions, normals, texcoords, shape, sampler, params.num * 5);
+  if (params.progressive) {
+    order_samples(positions, normals, texcoords, params.cell_size,
+        params.influence_radius, params.num);
+    positions.resize(params.num);
+    normals.resize(params.num);
+    texcoords.resize(params.num);
+  } else {
+    sample_elimination(positions, normals, texcoords, params.cell_size,
+        params.influence_radius, params.num);
   }
-  hair.normals = compute_normals(hair);
+  make_hair(hair, shape, sampler, positions, normals, params);
 }
 
 void make_grass(scene_data& scene, const instance_data& object,
@@ -689,12 +2748,6 @@ void make_grass(scene_data& scene, const instance_data& object,
 
 ////////////////////////////////////// Trees
 
-void addChild(struct Branch* parent, int child) {
-  parent->_children.push_back(child);
-}
-vector<int> getChildren(struct Branch* parent) { return parent->_children; }
-vector<int> getAttractors(struct Branch* parent) { return parent->_attractors; }
-
 void init_branch(struct Branch* b, vec3f start, vec3f end, vec3f direction,
     int parent, float thickness) {
   b->start        = start;
@@ -704,17 +2757,6 @@ void init_branch(struct Branch* b, vec3f start, vec3f end, vec3f direction,
   b->thickness    = thickness;
 }
 
-void draw_branch(scene_data& scene, struct Branch* b, int shape, int material) {
-  instance_data inst;
-  inst.material = material;
-  inst.shape    = shape;
-
-  inst.frame = frame_fromz(
-      interpolate_line(b->start, b->end, 0.5), b->direction);
-
-  scene.instances.push_back(inst);
-}
-
 void crown_points_distribution(vector<vec3f>* out, vec3f base,
     float crown_radius, int number, float height, int rng_seed = 678) {
   auto rng = make_rng(rng_seed);
@@ -745,14 +2787,163 @@ void bark_noise(shape_data& cil, vec3f start) {
     auto p = cil.positions[i];
     auto D = fbm22((p + start) * 150);
 
-    auto H = voronoise(D, 1, 0);
+    auto H = fast_voronoise(D, 1, 0);
 
     cil.colors.push_back(rgb_to_rgba(vec3f{0.4, 0.1, 0.0} * H));
   }
 }
 
+// Gets the material of tree branches, adding it to the scene if needed.
+static int get_branch_material(scene_data& scene, tree_shape_cache& cache) {
+  if (cache.material < 0) {
+    auto material  = material_data{};
+    material.color = {0.4, 0.1, 0.0};
+    material.type  = material_type::matte;
+    cache.material = (int)scene.materials.size();
+    scene.materials.push_back(material);
+  }
+  return cache.material;
+}
+
+// Merges trees made in a separate scene, with their own cache, into a scene,
+// reusing the cached shapes and materials of the scene and remapping the
+// indices of the others.
+static void merge_trees(scene_data& scene, tree_shape_cache& cache,
+    scene_data& trees, const tree_shape_cache& trees_cache) {
+  auto shape_map    = vector<int>(trees.shapes.size(), -1);
+  auto material_map = vector<int>(trees.materials.size(), -1);
+  auto merge_cached = [](int& cached, int index, vector<int>& map) {
+    if (index < 0) return;
+    if (cached >= 0) {
+      map[index] = cached;
+    } else {
+      cached = -2 - index;  // set when the element is added
+    }
+  };
+  for (auto& [key, shape] : trees_cache.segments) {
+    auto [segment, inserted] = cache.segments.insert({key, -2 - shape});
+    if (!inserted) shape_map[shape] = segment->second;
+  }
+  merge_cached(cache.sphere, trees_cache.sphere, shape_map);
+  merge_cached(cache.sphere_material, trees_cache.sphere_material,
+      material_map);
+  merge_cached(cache.material, trees_cache.material, material_map);
+  merge_cached(cache.range_material, trees_cache.range_material,
+      material_map);
+
+  // add the other elements and resolve the cache entries waiting for them
+  for (auto shape = 0; shape < (int)trees.shapes.size(); shape++) {
+    if (shape_map[shape] >= 0) continue;
+    shape_map[shape] = (int)scene.shapes.size();
+    scene.shapes.push_back(std::move(trees.shapes[shape]));
+  }
+  for (auto material = 0; material < (int)trees.materials.size();
+       material++) {
+    if (material_map[material] >= 0) continue;
+    material_map[material] = (int)scene.materials.size();
+    scene.materials.push_back(trees.materials[material]);
+  }
+  for (auto& [key, shape] : cache.segments) {
+    if (shape < -1) shape = shape_map[-2 - shape];
+  }
+  if (cache.sphere < -1) cache.sphere = shape_map[-2 - cache.sphere];
+  if (cache.sphere_material < -1)
+    cache.sphere_material = material_map[-2 - cache.sphere_material];
+  if (cache.material < -1) cache.material = material_map[-2 - cache.material];
+  if (cache.range_material < -1)
+    cache.range_material = material_map[-2 - cache.range_material];
+
+  // add instances
+  for (auto instance : trees.instances) {
+    instance.shape    = shape_map[instance.shape];
+    instance.material = material_map[instance.material];
+    scene.instances.push_back(instance);
+  }
+}
+
+// Adds a tree to a scene as a single mesh or, if `params.segments` is set,
+// as instances of cached segment shapes.
+static void add_tree_shapes(scene_data& scene, const tree_skeleton& tree,
+    int material, const tree_params& params, tree_shape_cache& cache,
+    int sides) {
+  if (!params.segments) {
+    scene.shapes.push_back(make_tree_shape(tree, sides));
+    auto instance     = instance_data{};
+    instance.shape    = (int)scene.shapes.size() - 1;
+    instance.material = material;
+    scene.instances.push_back(instance);
+    return;
+  }
+  for (auto branch = 0; branch < (int)tree.ends.size(); branch++) {
+    // segments with the same quantized thickness and length share a shape
+    auto& start  = tree.starts[branch];
+    auto& end    = tree.ends[branch];
+    auto  levels = (float)cache.levels;
+    auto  key    = vec2i{(int)round(log2(tree.thickness[branch]) * levels),
+        (int)round(log2(distance(start, end)) * levels)};
+    auto [segment, inserted] = cache.segments.insert(
+        {key, (int)scene.shapes.size()});
+    if (inserted) {
+      scene.shapes.push_back(make_uvcylinder({sides, 1, 1},
+          {exp2(key.x / levels), exp2(key.y / levels) / 2}, {1, 1, 1}));
+    }
+    auto instance     = instance_data{};
+    instance.shape    = segment->second;
+    instance.material = material;
+    instance.frame    = frame_fromz(
+        interpolate_line(start, end, 0.5f), tree.directions[branch]);
+    scene.instances.push_back(instance);
+  }
+}
+
+// Adds spheres at the crown points of a tree, sharing one shape.
+static void add_crown_points(scene_data& scene,
+    const vector<vec3f>& crown_points, tree_shape_cache& cache) {
+  if (cache.sphere < 0) {
+    auto sphere_material  = material_data{};
+    sphere_material.color = {1, 0, 0};
+    sphere_material.type  = material_type::matte;
+    cache.sphere          = (int)scene.shapes.size();
+    cache.sphere_material = (int)scene.materials.size();
+    scene.shapes.push_back(make_sphere(32, 0.01f));
+    scene.materials.push_back(sphere_material);
+  }
+  for (auto& point : crown_points) {
+    auto instance     = instance_data{};
+    instance.shape    = cache.sphere;
+    instance.material = cache.sphere_material;
+    instance.frame    = translation_frame(point);
+    scene.instances.push_back(instance);
+  }
+}
+
+// Adds a sphere showing the attraction range of a tree, sharing its material.
+static void add_range_sphere(scene_data& scene, const vec3f& center,
+    float range, tree_shape_cache& cache) {
+  if (cache.range_material < 0) {
+    auto range_material  = material_data{};
+    range_material.color = {0.8, 0.8, 0.8};
+    range_material.type  = material_type::transparent;
+    cache.range_material = (int)scene.materials.size();
+    scene.materials.push_back(range_material);
+  }
+  scene.shapes.push_back(make_sphere(32, range));
+  auto instance     = instance_data{};
+  instance.shape    = (int)scene.shapes.size() - 1;
+  instance.material = cache.range_material;
+  instance.frame    = translation_frame(center);
+  scene.instances.push_back(instance);
+}
+
 void generate_tree(scene_data& scene, const vec3f start, const vec3f norm,
     const tree_params& params, int rng_seed) {
+  auto cache = tree_shape_cache{};
+  generate_tree(scene, start, norm, params, rng_seed, cache);
+  std::cout << "Done!" << std::endl;
+}
+
+void generate_tree(scene_data& scene, const vec3f start, const vec3f norm,
+    const tree_params& params, int rng_seed, tree_shape_cache& cache) {
   const int BRANCH_FACES = 16;
 
   auto rng = make_rng(rng_seed);
@@ -773,33 +2964,15 @@ void generate_tree(scene_data& scene, const vec3f start, const vec3f norm,
       params.crown_points_distance * 0.4, params.crown_points_distance * 0.8,
       params.crown_points_num);
 
-  // draw the points for the visualization
-  auto          sphere = make_sphere(32, 0.01f);
-  material_data sphere_material;
-  sphere_material.color = {1, 0, 0};
-  sphere_material.type  = material_type::matte;
-  auto sphere_shape_idx = scene.shapes.size();
-  scene.shapes.push_back(sphere);
-  auto sphere_material_idx = scene.materials.size();
-  scene.materials.push_back(sphere_material);
-
   // simulate the growth of the tree
 
-  // create the cilinder
-  auto cilinder = make_uvcylinder(
-      vec3i{BRANCH_FACES, BRANCH_FACES, BRANCH_FACES},
-      vec2f{params.thickness, params.step_len / 2}, vec3f{(1), (1), (1)});
-
-  scene.shapes.push_back(cilinder);
-  auto cilinder_index = scene.shapes.size() - 1;
+  auto material_index = get_branch_material(scene, cache);
 
-  material_data segment_material;
-  segment_material.color = {0.4, 0.1, 0.0};
-  segment_material.type  = material_type::matte;
-  scene.materials.push_back(segment_material);
-  auto material_index = scene.materials.size() - 1;
-
-  auto initial_shape_number = scene.shapes.size() - 1;
+  // crown points are looked up in a grid, with removed ones marked dead
+  auto crown_grid = make_flat_grid(crown_points, params.range);
+  auto dead       = vector<bool>(crown_points.size(), false);
+  auto num_alive  = (int)crown_points.size();
+  auto neighbors  = vector<int>{};
 
   vector<struct Branch> branches;
   branches.push_back(first_branch);
@@ -807,12 +2980,9 @@ void generate_tree(scene_data& scene, const vec3f start, const vec3f norm,
   int division_flag = 0;
   try {
     for (int i = 0; i < params.steps; i++) {
-      if (i % 100 == 0) {
-        std::cout << i << std::endl;
-      }
       struct Branch current;
       struct Branch parent = branches[queue_start];
-      if (queue_start > branches.size() - 1 || crown_points.size() == 0) break;
+      if (queue_start > branches.size() - 1 || num_alive == 0) break;
       if (division_flag > 1) {
         if (!is_in_range(parent.start, params.step_len, params.crown_radius,
                 first_branch.start, params.crown_height)) {
@@ -828,7 +2998,10 @@ void generate_tree(scene_data& scene, const vec3f start, const vec3f norm,
       int   forks     = 0;
       // trovo i punti vicini
       auto sum = zero3f;
-      for (int i = crown_points.size() - 1; i >= 0; i--) {
+      find_neighbors(crown_grid, neighbors, cur_start, params.range);
+      std::sort(neighbors.begin(), neighbors.end(), std::greater<int>());
+      for (auto i : neighbors) {
+        if (dead[i]) continue;
         auto p                            = crown_points[i];
         auto dist                         = distance(p, cur_start);
         auto curstart_to_p                = normalize(p - cur_start);
@@ -838,7 +3011,8 @@ void generate_tree(scene_data& scene, const vec3f start, const vec3f norm,
             dot_curdirection_curstarttop > params.ignore_points_behind) {
           sum += curstart_to_p;
           if (dist < params.kill_range) {
-            crown_points.erase(crown_points.begin() + i);
+            dead[i] = true;
+            num_alive--;
             forks++;
           }
         }
@@ -854,17 +3028,7 @@ void generate_tree(scene_data& scene, const vec3f start, const vec3f norm,
           init_branch(&fork_branch, cur_start, fork_end, fork_norm, queue_start,
               parent.thickness * params.division_thickness_decrease);
           branches.push_back(fork_branch);
-
-          auto cil = make_uvcylinder(
-              vec3i{BRANCH_FACES, BRANCH_FACES, BRANCH_FACES},
-              vec2f{fork_branch.thickness, params.step_len / 2},
-              vec3f{(1), (1), (1)});
-          // bark_noise(cil, parent.start);
-          scene.shapes.push_back(cil);
-          draw_branch(
-              scene, &fork_branch, scene.shapes.size() - 1, material_index);
           division_flag++;
-          addChild(&parent, branches.size() - 1);
         }
       }
       //  cercolo il punto finale del branch
@@ -873,16 +3037,8 @@ void generate_tree(scene_data& scene, const vec3f start, const vec3f norm,
 
       init_branch(&current, cur_start, cur_end, norm, queue_start,
           parent.thickness * params.main_thickness_decrease);
-      auto cil = make_uvcylinder(
-          vec3i{BRANCH_FACES, BRANCH_FACES, BRANCH_FACES},
-          vec2f{current.thickness, params.step_len / 2}, vec3f{(1), (1), (1)});
-      // bark_noise(cil, parent.end);
-      scene.shapes.push_back(cil);
       branches.push_back(current);
       queue_start++;
-
-      draw_branch(scene, &current, scene.shapes.size() - 1, material_index);
-      addChild(&parent, branches.size() - 1);
     }
   } catch (std::bad_alloc& exception) {
     std::cout << "Bad Alloc!!!!" << std::endl;
@@ -890,45 +3046,35 @@ void generate_tree(scene_data& scene, const vec3f start, const vec3f norm,
     std::cout << "Size " << branches.size() << std::endl;
   }
 
+  // draw the tree
+  auto tree = tree_skeleton{};
+  for (auto i = 0; i < (int)branches.size(); i++) {
+    auto& branch = branches[i];
+    tree.starts.push_back(branch.start);
+    tree.ends.push_back(branch.end);
+    tree.directions.push_back(branch.direction);
+    tree.parents.push_back(i > 0 ? branch.parent_index : -1);
+    tree.thickness.push_back(branch.thickness);
+  }
+  add_tree_shapes(
+      scene, tree, (int)material_index, params, cache, BRANCH_FACES);
+
   // mostra i punti della chioma
   if (params.show_crown_points) {
-    for (auto& el : crown_points) {
-      instance_data new_point;
-      new_point.shape    = sphere_shape_idx;
-      new_point.material = sphere_material_idx;
-      new_point.frame    = frame3f{{1, 0, 0}, {0, 1, 0}, {0, 0, 1}, el};
-      scene.instances.push_back(new_point);
+    auto alive_points = vector<vec3f>{};
+    for (auto i = 0; i < (int)crown_points.size(); i++) {
+      if (!dead[i]) alive_points.push_back(crown_points[i]);
     }
+    add_crown_points(scene, alive_points, cache);
   }
 
   // mostra la grandezza della sfera di attrazione
-  if (params.show_range) {
-    material_data ray_sphere;
-    ray_sphere.color = {0.8, 0.8, 0.8};
-    ray_sphere.type  = material_type::transparent;
-    scene.materials.push_back(ray_sphere);
-    auto          ray_sphere_index = scene.materials.size() - 1;
-    instance_data new_ray_sphere;
-    new_ray_sphere.frame = frame3f{
-        {1, 0, 0}, {0, 1, 0}, {0, 0, 1}, branches.back().end};
-    new_ray_sphere.material = ray_sphere_index;
-    auto ray_sphere_sh      = make_sphere(32, params.range);
-    scene.shapes.push_back(ray_sphere_sh);
-    new_ray_sphere.shape = scene.shapes.size() - 1;
-    scene.instances.push_back(new_ray_sphere);
-  }
-  std::cout << "Done!" << std::endl;
+  if (params.show_range)
+    add_range_sphere(scene, branches.back().end, params.range, cache);
 }
 
-void make_woods(
-    scene_data& scene, const instance_data& object, const int tree_num) {
-  vector<vec3f> positions;
-  vector<vec3f> normals;
-  vector<vec2f> texcoords;
-  auto          rng = rng_state(1234, 789);
-  sample_shape(
-      positions, normals, texcoords, scene.shapes[object.shape], tree_num * 5);
-  sample_elimination(positions, normals, texcoords, 0.5f, 0.4f, tree_num);
+// Tree parameters of the trees of make_woods()
+static tree_params woods_tree_params() {
   auto tpar                        = tree_params{};
   tpar.step_len                    = 0.005;
   tpar.range                       = 0.01;  // attraction range
@@ -947,18 +3093,356 @@ void make_woods(
   tpar.gravity                     = 0.0;
   tpar.show_crown_points           = false;
   tpar.show_range                  = false;
+  return tpar;
+}
+
+void make_woods(scene_data& scene, const instance_data& object,
+    const int tree_num, bool segments) {
+  vector<vec3f> positions;
+  vector<vec3f> normals;
+  vector<vec2f> texcoords;
+  auto          rng = rng_state(1234, 789);
+  sample_shape(
+      positions, normals, texcoords, scene.shapes[object.shape], tree_num * 5);
+  sample_elimination(positions, normals, texcoords, 0.5f, 0.4f, tree_num);
+  auto tpar     = woods_tree_params();
+  tpar.segments = segments;
+
+  // grow trees in parallel, each in its own scene, and merge them in order
+  auto seeds = vector<int>(tree_num);
+  for (int i = 0; i < tree_num; i++) seeds[i] = rand1i(rng, 1 << 30);
+  auto trees  = vector<scene_data>(tree_num);
+  auto caches = vector<tree_shape_cache>(tree_num);
+  parallel_for(tree_num, [&](int i) {
+    generate_tree(
+        trees[i], positions[i], normals[i], tpar, seeds[i], caches[i]);
+  });
+  auto cache = tree_shape_cache{};
   for (int i = 0; i < tree_num; i++) {
-    generate_tree(scene, positions[i], normals[i], tpar, rand1f(rng));
+    merge_trees(scene, cache, trees[i], caches[i]);
+    trees[i] = {};
+  }
+}
+
+void make_forest(scene_data& scene, const instance_data& object,
+    const forest_params& params) {
+  // check parameters
+  if (params.num <= 0 || params.variants < 1) return;
+
+  // grow the variants of each species at the origin, in parallel
+  auto species      = params.species.empty()
+                          ? vector<tree_params>{woods_tree_params()}
+                          : params.species;
+  auto num_variants = (int)species.size() * params.variants;
+  auto rng          = make_rng(params.seed);
+  auto seeds        = vector<int>(num_variants);
+  for (auto& seed : seeds) seed = rand1i(rng, 1 << 30);
+  auto trees  = vector<scene_data>(num_variants);
+  auto caches = vector<tree_shape_cache>(num_variants);
+  parallel_for(num_variants, [&](int variant) {
+    generate_tree(trees[variant], {0, 0, 0}, {0, 1, 0},
+        species[variant / params.variants], seeds[variant], caches[variant]);
+  });
+
+  // merge them, keeping their instances as prototypes
+  auto cache      = tree_shape_cache{};
+  auto prototypes = vector<vector<instance_data>>(num_variants);
+  for (auto variant = 0; variant < num_variants; variant++) {
+    auto first = scene.instances.size();
+    merge_trees(scene, cache, trees[variant], caches[variant]);
+    trees[variant] = {};
+    prototypes[variant].assign(
+        scene.instances.begin() + first, scene.instances.end());
+    scene.instances.resize(first);
   }
+
+  // choose the variant of each tree
+  auto& shape     = scene.shapes[object.shape];
+  auto  positions = vector<vec3f>{};
+  auto  normals   = vector<vec3f>{};
+  auto  texcoords = vector<vec2f>{};
+  sample_shape(positions, normals, texcoords, shape, make_shape_sampler(shape),
+      params.num, params.seed);
+  auto variants = vector<int>(params.num);
+  auto offsets  = vector<size_t>(params.num + 1, 0);
+  for (auto idx = 0; idx < params.num; idx++) {
+    variants[idx]    = rand1i(rng, num_variants);
+    offsets[idx + 1] = offsets[idx] + prototypes[variants[idx]].size();
+  }
+
+  // place the trees aligned to the object normals, with a random rotation
+  // and scale, in parallel chunks with their own random streams
+  const auto chunk_size = 4096;
+  auto       num_chunks = (params.num + chunk_size - 1) / chunk_size;
+  auto       first      = scene.instances.size();
+  scene.instances.resize(first + offsets.back());
+  parallel_for(num_chunks, [&](int chunk) {
+    auto rng = make_rng(params.seed, chunk + 1);
+    auto end = min(params.num, (chunk + 1) * chunk_size);
+    for (auto idx = chunk * chunk_size; idx < end; idx++) {
+      auto frame = frame3f{};
+      frame.y    = normals[idx];
+      frame.x    = orthonormalize(
+          abs(frame.y.x) < 0.9f ? vec3f{1, 0, 0} : vec3f{0, 0, 1}, frame.y);
+      frame.z    = cross(frame.x, frame.y);
+      frame.o    = positions[idx];
+      frame *= rotation_frame(vec3f{0, 1, 0}, rand1f(rng) * 2 * pif);
+      auto scale = params.scale.x +
+                   (params.scale.y - params.scale.x) * rand1f(rng);
+      frame *= scaling_frame(vec3f{scale, scale, scale});
+      auto instance = scene.instances.begin() + first + offsets[idx];
+      for (auto& prototype : prototypes[variants[idx]]) {
+        *instance       = prototype;
+        instance->frame = frame * prototype.frame;
+        instance++;
+      }
+    }
+  });
 }
 
 /////////////////////////////////////////
 
-struct attractor {
-  int   attractor_idx;
-  int   branch_idx;
-  float distance;
-};
+tree_skeleton grow_tree_skeleton(const vector<vec3f>& attractors,
+    const vec3f& start, const vec3f& norm, const tree_params& params) {
+  // branch ends are kept in a grid that grows with the tree, and track the
+  // pull of their attractors and the closest of them
+  auto tree       = tree_skeleton{};
+  auto ends       = make_hash_grid(params.step_len);
+  auto children   = vector<int>{};
+  auto pulls      = vector<vec3f>{};
+  auto closest    = vector<int>{};
+  auto add_branch = [&](int parent, const vec3f& start,
+                        const vec3f& direction, float thickness) {
+    tree.starts.push_back(start);
+    tree.ends.push_back(start + direction * params.step_len);
+    tree.directions.push_back(direction);
+    tree.parents.push_back(parent);
+    tree.thickness.push_back(thickness);
+    children.push_back(0);
+    pulls.push_back(zero3f);
+    closest.push_back(-1);
+    if (parent >= 0) children[parent]++;
+    insert_vertex(ends, tree.ends.back());
+  };
+  add_branch(-1, start, norm, params.thickness);
+
+  // attractors are kept in a static grid, with removed ones marked dead, and
+  // assigned to their nearest branch end, updated only for new branches
+  auto grid             = make_flat_grid(attractors, params.range);
+  auto dead             = vector<bool>(attractors.size(), false);
+  auto nearest          = vector<int>(attractors.size(), -1);
+  auto nearest_distance = vector<float>(attractors.size(), flt_max);
+  auto alive            = vector<int>(attractors.size());
+  auto candidates       = vector<vector<int>>{};
+  auto assignments      = vector<vec2i>{};
+  auto groups           = vector<int>{};
+  auto pulled           = vector<int>{};
+  auto neighbors        = vector<int>{};
+  auto reach            = 0.0f;
+  for (auto idx = 0; idx < (int)attractors.size(); idx++) {
+    alive[idx] = idx;
+    reach      = max(reach, distance(attractors[idx], start) + params.range);
+  }
+
+  // checks if a branch would overlap others, as when attractors pull evenly
+  auto overlaps = [&](int branch, const vec3f& direction) {
+    auto end = tree.ends[branch] + direction * params.step_len;
+    find_neighbors(ends, neighbors, end, params.step_len / 4);
+    return !neighbors.empty();
+  };
+
+  // grow the tree
+  auto crowned = false;
+  auto first   = 0;
+  for (auto step = 0; step < params.steps && !alive.empty(); step++) {
+    // find the attractors in range of new branch ends, in parallel
+    auto num_branches = (int)tree.ends.size();
+    candidates.resize(num_branches - first);
+    parallel_for(num_branches - first, [&](int idx) {
+      auto& end   = tree.ends[first + idx];
+      auto& found = candidates[idx];
+      find_neighbors(grid, found, end, params.range);
+      found.erase(std::remove_if(found.begin(), found.end(),
+                      [&](int point) {
+                        return dead[point] ||
+                               dot(normalize(attractors[point] - end),
+                                   tree.directions[first + idx]) <=
+                                   params.ignore_points_behind;
+                      }),
+          found.end());
+    });
+
+    // assign them if nearer than their current branch end, in parallel over
+    // the attractors, each checking the new branch ends that found it in
+    // branch order
+    assignments.clear();
+    for (auto idx = 0; idx < num_branches - first; idx++) {
+      for (auto point : candidates[idx])
+        assignments.push_back({point, first + idx});
+    }
+    std::sort(assignments.begin(), assignments.end(),
+        [](const vec2i& a, const vec2i& b) {
+          return a.x < b.x || (a.x == b.x && a.y < b.y);
+        });
+    groups.clear();
+    for (auto idx = 0; idx < (int)assignments.size(); idx++) {
+      if (idx == 0 || assignments[idx].x != assignments[idx - 1].x)
+        groups.push_back(idx);
+    }
+    groups.push_back((int)assignments.size());
+    parallel_for((int)groups.size() - 1, [&](int group) {
+      for (auto idx = groups[group]; idx < groups[group + 1]; idx++) {
+        auto [point, branch] = assignments[idx];
+        auto dist = distance(attractors[point], tree.ends[branch]);
+        if (dist >= nearest_distance[point]) continue;
+        nearest[point]          = branch;
+        nearest_distance[point] = dist;
+      }
+    });
+    first = num_branches;
+
+    // sum the pull of the attractors on each branch end
+    pulled.clear();
+    for (auto point : alive) {
+      auto branch = nearest[point];
+      if (branch < 0) continue;
+      if (closest[branch] < 0) pulled.push_back(branch);
+      if (closest[branch] < 0 ||
+          nearest_distance[point] < nearest_distance[closest[branch]])
+        closest[branch] = point;
+      pulls[branch] += normalize(attractors[point] - tree.ends[branch]);
+    }
+
+    // grow new branches, or the trunk until it reaches the crown
+    if (pulled.empty()) {
+      auto last = num_branches - 1;
+      if (crowned || distance(tree.ends[last], start) > reach) break;
+      add_branch(last, tree.ends[last], tree.directions[last],
+          tree.thickness[last] * params.main_thickness_decrease);
+    } else {
+      crowned = true;
+      for (auto branch : pulled) {
+        // grow towards the mean direction of the attractors, or towards the
+        // closest one if that is taken
+        auto strictness = tree.directions[branch] * params.branch_strictness;
+        auto gravity    = vec3f{0, params.gravity, 0};
+        auto direction  = normalize(
+            normalize(pulls[branch] + strictness) - gravity);
+        if (overlaps(branch, direction)) {
+          auto& point = attractors[closest[branch]];
+          auto  pull  = normalize(point - tree.ends[branch]);
+          direction   = normalize(normalize(pull + strictness) - gravity);
+        }
+        pulls[branch]   = zero3f;
+        closest[branch] = -1;
+        if (overlaps(branch, direction)) continue;
+        auto decrease = children[branch] > 0
+                            ? params.division_thickness_decrease
+                            : params.main_thickness_decrease;
+        add_branch(branch, tree.ends[branch], direction,
+            tree.thickness[branch] * decrease);
+      }
+      if ((int)tree.ends.size() == num_branches) break;
+    }
+
+    // remove the attractors reached by the new branches
+    for (auto branch = num_branches; branch < (int)tree.ends.size();
+         branch++) {
+      find_neighbors(grid, neighbors, tree.ends[branch], params.kill_range);
+      for (auto point : neighbors) dead[point] = true;
+    }
+    alive.erase(std::remove_if(alive.begin(), alive.end(),
+                    [&dead](int point) { return (bool)dead[point]; }),
+        alive.end());
+  }
+
+  return tree;
+}
+
+shape_data make_tree_shape(const tree_skeleton& tree, int sides) {
+  // the thickest child of each branch continues its tube, the others fork
+  auto num_branches = (int)tree.ends.size();
+  auto continuation = vector<int>(num_branches, -1);
+  auto num_children = vector<int>(num_branches, 0);
+  for (auto branch = 0; branch < num_branches; branch++) {
+    auto parent = tree.parents[branch];
+    if (parent < 0) continue;
+    auto& child = continuation[parent];
+    if (child < 0 || tree.thickness[branch] > tree.thickness[child])
+      child = branch;
+    num_children[parent]++;
+  }
+
+  // rings of `sides + 1` vertices, with the seam duplicated for texcoords,
+  // oriented by a reference direction carried along the tubes
+  auto shape    = shape_data{};
+  auto add_ring = [&shape, sides](const vec3f& center, const vec3f& tangent,
+                      const vec3f& reference, float radius, float v) {
+    auto ring = (int)shape.positions.size();
+    auto x    = reference - tangent * dot(reference, tangent);
+    x = length(x) > 0.001f ? normalize(x) : basis_fromz(tangent).x;
+    auto y = cross(tangent, x);
+    for (auto side = 0; side <= sides; side++) {
+      auto angle  = 2 * pif * side / sides;
+      auto normal = x * cos(angle) + y * sin(angle);
+      shape.positions.push_back(center + normal * radius);
+      shape.normals.push_back(normal);
+      shape.texcoords.push_back({(float)side / sides, v});
+    }
+    return ring;
+  };
+
+  // sweep branches from parents to children, sharing the rings at joints
+  auto end_rings  = vector<int>(num_branches);
+  auto references = vector<vec3f>(num_branches);
+  auto lengths    = vector<float>(num_branches);
+  for (auto branch = 0; branch < num_branches; branch++) {
+    auto  parent     = tree.parents[branch];
+    auto& direction  = tree.directions[branch];
+    auto  start_ring = 0;
+    auto  reference  = parent >= 0 ? references[parent]
+                                   : basis_fromz(direction).x;
+    auto  start_v    = parent >= 0 ? lengths[parent] : 0.0f;
+    if (parent >= 0 && continuation[parent] == branch) {
+      start_ring = end_rings[parent];
+    } else {
+      start_ring = add_ring(tree.starts[branch], direction, reference,
+          tree.thickness[branch], start_v);
+    }
+
+    // end ring, halfway to the continuing branch for smooth joints, with the
+    // thickness of that branch
+    auto child   = continuation[branch];
+    auto tangent = child >= 0 ? normalize(direction + tree.directions[child])
+                              : direction;
+    auto radius  = child >= 0 ? tree.thickness[child] : tree.thickness[branch];
+    auto end_v   = start_v + distance(tree.starts[branch], tree.ends[branch]);
+    lengths[branch]    = end_v;
+    end_rings[branch]  = add_ring(
+        tree.ends[branch], tangent, reference, radius, end_v);
+    references[branch] = shape.positions[end_rings[branch]] -
+                         tree.ends[branch];
+    for (auto side = 0; side < sides; side++) {
+      shape.quads.push_back({start_ring + side, start_ring + side + 1,
+          end_rings[branch] + side + 1, end_rings[branch] + side});
+    }
+
+    // close tips
+    if (num_children[branch] == 0) {
+      auto center = (int)shape.positions.size();
+      shape.positions.push_back(tree.ends[branch]);
+      shape.normals.push_back(direction);
+      shape.texcoords.push_back({0.5f, lengths[branch]});
+      for (auto side = 0; side < sides; side++) {
+        shape.quads.push_back({end_rings[branch] + side,
+            end_rings[branch] + side + 1, center, center});
+      }
+    }
+  }
+
+  return shape;
+}
+
 void generate_tree_2(scene_data& scene, const vec3f start, const vec3f norm,
     const tree_params& params, int seed) {
   const int BRANCH_FACES = 16;
@@ -980,112 +3464,22 @@ void generate_tree_2(scene_data& scene, const vec3f start, const vec3f norm,
       params.crown_points_distance * 0.4, params.crown_points_distance * 0.8,
       params.crown_points_num);
 
-  // draw the points for the visualization
-  auto          sphere = make_sphere(32, 0.01f);
-  material_data sphere_material;
-  sphere_material.color = {1, 0, 0};
-  sphere_material.type  = material_type::matte;
-  auto sphere_shape_idx = scene.shapes.size();
-  scene.shapes.push_back(sphere);
-  auto sphere_material_idx = scene.materials.size();
-  scene.materials.push_back(sphere_material);
-
   // simulate the growth of the tree
 
-  // create the cilinder
-  auto cilinder = make_uvcylinder(
-      vec3i{BRANCH_FACES, BRANCH_FACES, BRANCH_FACES},
-      vec2f{params.thickness, params.step_len / 2}, vec3f{(1), (1), (1)});
-
-  scene.shapes.push_back(cilinder);
-  auto cilinder_index = scene.shapes.size() - 1;
+  auto cache          = tree_shape_cache{};
+  auto material_index = get_branch_material(scene, cache);
 
-  material_data segment_material;
-  segment_material.color = {0.4, 0.1, 0.0};
-  segment_material.type  = material_type::matte;
-  scene.materials.push_back(segment_material);
-  auto material_index = scene.materials.size() - 1;
-
-  auto initial_shape_number = scene.shapes.size() - 1;
-
-  vector<struct Branch> branches;
-  branches.push_back(first_branch);
-  int queue_start = 0;
-  int steps       = 0;
-  while (!crown_points.empty() && steps < params.steps) {
-    // calcolo gli attraction points
-    auto        point_num = 0;
-    vector<int> active_branches;
-    for (int i = 0; i < crown_points.size(); i++) {
-      auto  attr     = crown_points[i];
-      auto  min_idx  = -1;
-      float min_dist = INFINITY;
-      for (int j = 0; j < branches.size(); j++) {
-        auto branch = branches[j];
-        auto d      = distance(branch.end, attr);
-        if (d <= params.range && d < min_dist) {
-          min_dist = d;
-          min_idx  = j;
-        }
-      }
-      if (min_idx != -1) {
-        branches[min_idx]._attractors.push_back(i);
-        active_branches.push_back(min_idx);
-
-        std::cout << min_idx << std::endl;
-        point_num++;
-      }
-    }
-    if (point_num == 0) break;
-    for (auto& idx : active_branches) {
-      // calcolo la nuova direzione
-      auto branch = branches[idx];
-
-      // std::cout << branch._attractors.size() << std::endl;
-      vec3f direction = zero3f;
-      for (auto& attr : branch._attractors) {
-        direction += normalize(crown_points[attr] - branch.end);
-      }
-      direction = normalize(direction);
-
-      std::cout << direction.y << std::endl;
-      branches[idx]._attractors.clear();
-      struct Branch new_branch;
-      init_branch(&branch, branch.end, branch.end + direction * params.step_len,
-          direction, idx, branch.thickness * params.main_thickness_decrease);
-      draw_branch(scene, &new_branch, cilinder_index, material_index);
-      branches.push_back(new_branch);
-    }
-    steps++;
-  }
+  // grow and draw the tree
+  auto tree = grow_tree_skeleton(crown_points, start, norm, params);
+  add_tree_shapes(
+      scene, tree, (int)material_index, params, cache, BRANCH_FACES);
 
   // mostra i punti della chioma
-  if (params.show_crown_points) {
-    for (auto& el : crown_points) {
-      instance_data new_point;
-      new_point.shape    = sphere_shape_idx;
-      new_point.material = sphere_material_idx;
-      new_point.frame    = frame3f{{1, 0, 0}, {0, 1, 0}, {0, 0, 1}, el};
-      scene.instances.push_back(new_point);
-    }
-  }
+  if (params.show_crown_points) add_crown_points(scene, crown_points, cache);
 
   // mostra la grandezza della sfera di attrazione
-  if (params.show_range) {
-    material_data ray_sphere;
-    ray_sphere.color = {0.8, 0.8, 0.8};
-    ray_sphere.type  = material_type::transparent;
-    scene.materials.push_back(ray_sphere);
-    auto          ray_sphere_index = scene.materials.size() - 1;
-    instance_data new_ray_sphere;
-    new_ray_sphere.frame = frame3f{
-        {1, 0, 0}, {0, 1, 0}, {0, 0, 1}, branches.back().end};
-    new_ray_sphere.material = ray_sphere_index;
-    auto ray_sphere_sh      = make_sphere(32, params.range);
-    scene.shapes.push_back(ray_sphere_sh);
-    new_ray_sphere.shape = scene.shapes.size() - 1;
-    scene.instances.push_back(new_ray_sphere);
-  }
+  if (params.show_range)
+    add_range_sphere(scene, tree.ends.back(), params.range, cache);
   std::cout << "Done!" << std::endl;
 }
 /////////////////////////////////////////////////
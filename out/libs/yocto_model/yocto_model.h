@@ -36,6 +36,7 @@
 
 #include <yocto/yocto_geometry.h>
 #include <yocto/yocto_math.h>
+#include <yocto/yocto_sampling.h>
 #include <yocto/yocto_scene.h>
 
 #include <array>
@@ -54,50 +55,230 @@ using std::vector;
 
 }  // namespace yocto
 
+// -----------------------------------------------------------------------------
+// NOISE FUNCTIONS
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Perlin noise and its fractal sums evaluated over arrays of positions, each
+// multiplied by `scale` first. Noise is computed 8 (AVX2) or 4 (SSE4) points
+// at a time, with the kernel chosen at runtime and a scalar fallback. Results
+// match the per-point versions used by the generators exactly.
+void noise(vector<float>& values, const vector<vec3f>& positions, float scale);
+void fbm(vector<float>& values, const vector<vec3f>& positions, float scale,
+    int octaves);
+void turbulence(vector<float>& values, const vector<vec3f>& positions,
+    float scale, int octaves);
+void ridge(vector<float>& values, const vector<vec3f>& positions, float scale,
+    int octaves);
+void noise(float* values, const vec3f* positions, int num, float scale);
+void fbm(float* values, const vec3f* positions, int num, float scale,
+    int octaves);
+void turbulence(float* values, const vec3f* positions, int num, float scale,
+    int octaves);
+void ridge(float* values, const vec3f* positions, int num, float scale,
+    int octaves);
+
+// Same as above, also computing the analytic gradients of the values with
+// respect to the positions. Values match the versions above exactly.
+void fbm(float* values, vec3f* gradients, const vec3f* positions, int num,
+    float scale, int octaves);
+void turbulence(float* values, vec3f* gradients, const vec3f* positions,
+    int num, float scale, int octaves);
+void ridge(float* values, vec3f* gradients, const vec3f* positions, int num,
+    float scale, int octaves);
+
+// Voronoise by Inigo Quilez, that blends cell noise (u=1, v=0), voronoi
+// (u=1, v=1), value noise (u=0, v=0) and smooth noise (u=0, v=1).
+// `voronoise()` is the reference implementation that visits all 125 neighbor
+// cells, hashing them with the original sin-based hash or with an integer
+// hash. `fast_voronoise()` uses the integer hash and float math and skips the
+// cells that cannot contribute. It matches the reference with
+// `integer_hash = true` within `voronoise_tolerance`.
+float voronoise(const vec3f& x, float u, float v, bool integer_hash = false);
+float fast_voronoise(const vec3f& x, float u, float v);
+const float voronoise_tolerance = 1e-5f;
+
+// Checks `fast_voronoise()` against the reference at `num` random positions
+// and blends, failing with the largest error if it exceeds
+// `voronoise_tolerance`.
+bool check_voronoise(int num, string& error);
+
+// Cell noise values at a position: distances to the nearest (f1) and second
+// nearest (f2) cell feature points, and distance to the nearest cell border.
+struct cell_noise_sample {
+  float f1     = 0;
+  float f2     = 0;
+  float border = 0;
+};
+
+// Evaluates cell noise at positions multiplied by `scale`. Positions are
+// bucketed by cell, so feature points and border planes are computed once
+// per cell and shared by all the positions that fall in it.
+void cell_noise(vector<cell_noise_sample>& samples,
+    const vector<vec3f>& positions, float scale);
+void cell_noise(cell_noise_sample* samples, const vec3f* positions, int num,
+    float scale);
+
+// Smooth voronoi, the smooth minimum of the distances to the feature points.
+float smoothVoronoi(vec3f x);
+
+}  // namespace yocto
+
 // -----------------------------------------------------------------------------
 // EXAMPLE OF PROCEDURAL MODELING
 // -----------------------------------------------------------------------------
 namespace yocto {
 
+// Terrains and displacements are computed at the shape vertices. If
+// `adaptive_tolerance` is not zero, the shape is first tessellated, for up to
+// `adaptive_levels` rounds, by splitting the edges whose midpoint height
+// differs from the interpolated one by more than `adaptive_tolerance`.
+// If `cache` is set, the noise values of `make_terrain()` and
+// `make_displacement()` are memory-mapped from a cache in that directory,
+// keyed by the shape positions and the noise scale and octaves, so runs that
+// only change heights and colors skip noise evaluation. The cache is not used
+// with adaptive tessellation or analytic normals. Normals are computed from
+// the noise gradients if `analytic_normals` is set, which only
+// `make_terrain()` and `make_displacement()` support, and from the displaced
+// mesh otherwise.
 struct terrain_params {
-  float size    = 0.1f;
-  vec3f center  = zero3f;
-  float height  = 0.1f;
-  float scale   = 10;
-  int   octaves = 8;
-  vec4f bottom  = srgb_to_rgb(vec4f{154, 205, 50, 255} / 255);
-  vec4f middle  = srgb_to_rgb(vec4f{205, 133, 63, 255} / 255);
-  vec4f top     = srgb_to_rgb(vec4f{240, 255, 255, 255} / 255);
+  float  size               = 0.1f;
+  vec3f  center             = zero3f;
+  float  height             = 0.1f;
+  float  scale              = 10;
+  int    octaves            = 8;
+  bool   analytic_normals   = false;  // make_terrain() only
+  float  adaptive_tolerance = 0;
+  int    adaptive_levels    = 4;
+  string cache              = "";
+  vec4f  bottom             = srgb_to_rgb(vec4f{154, 205, 50, 255} / 255);
+  vec4f  middle             = srgb_to_rgb(vec4f{205, 133, 63, 255} / 255);
+  vec4f  top                = srgb_to_rgb(vec4f{240, 255, 255, 255} / 255);
 };
 
 void make_terrain(shape_data& shape, const terrain_params& params);
 
+// Tiled terrains cover `tiles` square tiles of side `tile_size`, each made of
+// `tile_steps` x `tile_steps` quads, centered at the terrain center.
+// At most `in_flight` tiles are in memory at once, or one per hardware thread
+// if zero.
+struct terrain_tile_params {
+  vec2i tiles      = {4, 4};
+  int   tile_steps = 256;
+  float tile_size  = 0.05f;
+  int   in_flight  = 0;
+};
+
+// Makes the terrain of `make_terrain()` on the y = 0 plane one tile at a time,
+// saving each tile to `dirname/tile_<i>_<j>.ply`. Tiles are generated in
+// parallel, so memory depends on the tile size, not the terrain size.
+bool make_terrain_tiles(const string& dirname, const terrain_params& params,
+    const terrain_tile_params& tparams, string& error);
+
+// Levels of detail of terrain tiles. Each level halves the grid resolution
+// and evaluates one less noise octave than the previous one, and has a skirt
+// of depth `skirt` that hides cracks against tiles at other levels. Level l
+// is used up to a camera distance of `distance * 2^l`. Halving stops at the
+// first odd grid size, so use a power of two `tile_steps` for all levels.
+struct terrain_lod_params {
+  int   levels   = 4;
+  float distance = 0.1f;
+  float skirt    = 0.01f;
+};
+
+// Terrain tile at all levels of detail, with the bounds of the finest level.
+struct terrain_lod {
+  vec2i              tile   = {0, 0};
+  bbox3f             bounds = invalidb3f;
+  vector<shape_data> levels = {};
+};
+
+// Makes the levels of detail of all the tiles of a tiled terrain.
+vector<terrain_lod> make_terrain_lods(const terrain_params& params,
+    const terrain_tile_params& tparams, const terrain_lod_params& lparams);
+
+// Selects the level of detail of a tile from the camera distance.
+int select_terrain_lod(const terrain_lod& lod, const vec3f& camera,
+    const terrain_lod_params& lparams);
+
+// Adds the tiles to a scene at the level of detail selected for the camera.
+void add_terrain_lods(scene_data& scene, const vector<terrain_lod>& lods,
+    const vec3f& camera, const terrain_lod_params& lparams);
+
 struct displacement_params {
-  float height  = 0.02f;
-  float scale   = 50;
-  int   octaves = 8;
-  vec4f bottom  = srgb_to_rgb(vec4f{64, 224, 208, 255} / 255);
-  vec4f top     = srgb_to_rgb(vec4f{244, 164, 96, 255} / 255);
+  float  height             = 0.02f;
+  float  scale              = 50;
+  int    octaves            = 8;
+  bool   analytic_normals   = false;  // make_displacement() only
+  float  adaptive_tolerance = 0;
+  int    adaptive_levels    = 4;
+  string cache              = "";
+  vec4f  bottom             = srgb_to_rgb(vec4f{64, 224, 208, 255} / 255);
+  vec4f  top                = srgb_to_rgb(vec4f{244, 164, 96, 255} / 255);
 };
 
 void make_displacement(shape_data& shape, const displacement_params& params);
 
+// Surface sampler of a shape, that picks triangles in proportion to their
+// area with an alias table. Build it once to sample a shape many times.
+struct shape_sampler {
+  vector<vec3i> triangles = {};
+  alias_table   table     = {};
+};
+
+// Makes a surface sampler for a shape.
+shape_sampler make_shape_sampler(const shape_data& shape);
+
+// Samples `num` points uniformly on a shape. Samples are drawn in parallel
+// in chunks, each with its own random stream of `seed`, so the result only
+// depends on the seed.
+void sample_shape(vector<vec3f>& positions, vector<vec3f>& normals,
+    vector<vec2f>& texcoords, const shape_data& shape,
+    const shape_sampler& sampler, int num, uint64_t seed = 19873991);
+void sample_shape(vector<vec3f>& positions, vector<vec3f>& normals,
+    vector<vec2f>& texcoords, const shape_data& shape, int num);
+
 struct hair_params {
-  int   num              = 100000;
-  int   steps            = 1;
-  float lenght           = 0.02f;
-  float scale            = 250;
-  float strength         = 0.01f;
-  float gravity          = 0.0f;
-  vec4f bottom           = srgb_to_rgb(vec4f{25, 25, 25, 255} / 255);
-  vec4f top              = srgb_to_rgb(vec4f{244, 164, 96, 255} / 255);
-  float influence_radius = 0.005;
-  float cell_size        = 0.005;
+  int   num                  = 100000;
+  int   steps                = 1;
+  float lenght               = 0.02f;
+  float scale                = 250;
+  float strength             = 0.01f;
+  float gravity              = 0.0f;
+  vec4f bottom               = srgb_to_rgb(vec4f{25, 25, 25, 255} / 255);
+  vec4f top                  = srgb_to_rgb(vec4f{244, 164, 96, 255} / 255);
+  float influence_radius     = 0.005;
+  float cell_size            = 0.005;
+  bool  progressive          = false;
+  int   curves               = 0;
+  float collision_offset     = 0;
+  float collision_radius     = 0;
+  int   collision_iterations = 4;
+  int   guides               = 0;
+  float clumping             = 0;
 };
 
+// Hair strands are polylines of `steps` lines. If `curves` is not zero,
+// strands are fitted with that many cubic Bezier curves, stored as their
+// control polygons as in `bezier_to_lines()`, with colors interpolated from
+// `bottom` at the root to `top` at the tip. The output then holds control
+// points only: call `tesselate_beziers()` to get polylines, or save it in a
+// shape named with a `_bezier` suffix, that is tesselated when the scene is
+// loaded. If `guides` is not zero, only that many strands are grown, and the
+// others are interpolated from their nearest guides and pulled together by
+// `clumping`, from 0 to 1.
 void make_hair(
     shape_data& hair, const shape_data& shape, const hair_params& params);
 
+// Corrects hair strands, but their roots, so that they stay at least
+// `collision_offset` outside the base shape, found with a BVH, and at least
+// `collision_radius` away from other strands, found with a flat grid, for
+// `collision_iterations` iterations. Strands are processed in parallel.
+// Called by the hair generators if either distance is not zero.
+void collide_hair(
+    shape_data& hair, const shape_data& shape, const hair_params& params);
+
 struct grass_params {
   int num = 10000;
 };
@@ -116,9 +297,46 @@ void make_smooth_voro_displacement(
     shape_data& shape, const displacement_params& params);
 void make_voro_displacement(
     shape_data& shape, const displacement_params& params, float u, float v);
+void make_noise_displacement(shape_data& shape,
+    const struct noise_graph& graph, const displacement_params& params);
+// Hair with roots thinned by sample elimination. If `progressive` is set,
+// strands are ordered so that any prefix of them is evenly spread.
 void make_hair_sample_elimination(
     shape_data& hair, const shape_data& shape, const hair_params& params);
 
+// Neighbor lists of a point set in compressed form. The neighbors of point i
+// are `indices[k]`, at distance `distances[k]`, for k in
+// [`offsets[i]`, `offsets[i + 1]`).
+struct neighbor_lists {
+  vector<int>   offsets   = {};
+  vector<int>   indices   = {};
+  vector<float> distances = {};
+};
+
+// Finds the neighbors closer than `radius` of all points in parallel, using a
+// flat grid with cells of size `cell_size`.
+neighbor_lists make_neighbor_lists(
+    const vector<vec3f>& positions, float cell_size, float radius);
+
+// Weighted sample elimination. Samples are removed one at a time in order of
+// weight, the sum over the neighbors closer than `influence_radius` of
+// (1 - d / (2 * influence_radius))^8, until `num` are left. Weights are kept
+// in an indexed heap and updated as neighbors are removed, in O(n log n).
+// Returns the indices of the kept samples in increasing order.
+vector<int> eliminate_samples(const vector<vec3f>& positions, float cell_size,
+    float influence_radius, int num);
+
+// Progressive sample elimination. Orders all samples so that any prefix is a
+// well distributed subset. Samples are halved in stages by elimination, with
+// the radius scaled from `influence_radius`, the radius for `num` samples, to
+// match the density of each stage; each stage is ordered by reverse removal.
+vector<int> order_samples(const vector<vec3f>& positions, float cell_size,
+    float influence_radius, int num);
+// Reorders samples in place with progressive sample elimination.
+void order_samples(vector<vec3f>& positions, vector<vec3f>& normals,
+    vector<vec2f>& texcoords, float cell_size, float influence_radius,
+    int num);
+
 struct Branch {
   vec3f start;
 
@@ -129,16 +347,8 @@ struct Branch {
   int parent_index;
 
   float thickness;
-
-  vector<int> _children;
-
-  vector<int> _attractors;
 };
 
-void        addChild(struct Branch* parent, int child);
-vector<int> getChildren(struct Branch* parent);
-vector<int> getAttractors(struct Branch* parent);
-
 void init_branch(
     struct Branch* b, vec3f start, vec3f end, vec3f direction, int parent);
 
@@ -160,12 +370,79 @@ struct tree_params {
   float gravity                     = 0.0;
   bool  show_crown_points           = false;
   bool  show_range                  = false;
+  bool  segments                    = false;  // draw instanced segments
+};
+
+// Tree skeleton, made of branches that start at the end of their parent.
+// The first branch has no parent.
+struct tree_skeleton {
+  vector<vec3f> starts     = {};
+  vector<vec3f> ends       = {};
+  vector<vec3f> directions = {};
+  vector<int>   parents    = {};
+  vector<float> thickness  = {};
+};
+
+// Grows a tree skeleton from `start` by space colonization for at most
+// `steps` iterations. At each iteration, attractors pull the nearest branch
+// end within `range` that does not point away from them, pulled branch ends
+// grow a branch towards their attractors, and attractors within `kill_range`
+// of new branch ends are removed. The trunk grows along `norm` until it
+// reaches the attractors. Attractors are kept in a flat grid, with removed
+// ones marked dead, and branch ends in a hash grid that grows with the tree,
+// and attractors are assigned in parallel.
+tree_skeleton grow_tree_skeleton(const vector<vec3f>& attractors,
+    const vec3f& start, const vec3f& norm, const tree_params& params);
+
+// Makes a single mesh for a tree skeleton, sweeping tubes of `sides` quads
+// along the branches. Each branch continues in its thickest child, sharing
+// the joint ring, whose thickness is the child's and is oriented halfway
+// between the two branches, so tubes are continuous and smooth; the other
+// children start new tubes. Tips are closed.
+shape_data make_tree_shape(const tree_skeleton& tree, int sides = 16);
+
+// Shapes and materials shared by the trees of a scene, added to the scene
+// when first used. Trees drawn as segments use cylinders whose thickness and
+// length are quantized to `levels` steps per halving, so that segments with
+// similar sizes, as made by the thickness decrease of each step, share
+// the same shape across trees. Crown points share a sphere, and branches
+// and attraction range spheres share a material each.
+struct tree_shape_cache {
+  int                       levels          = 8;
+  unordered_map<vec2i, int> segments        = {};
+  int                       sphere          = -1;
+  int                       sphere_material = -1;
+  int                       material        = -1;
+  int                       range_material  = -1;
 };
 
 void generate_tree(scene_data& scene, const vec3f start, const vec3f norm,
     const tree_params& params, int rng_seed);
-void make_woods(
-    scene_data& scene, const instance_data& object, const int tree_num);
+void generate_tree(scene_data& scene, const vec3f start, const vec3f norm,
+    const tree_params& params, int rng_seed, tree_shape_cache& cache);
+// Makes a forest of trees on an object. Trees are grown in parallel, each
+// in its own scene with its own cache, and then merged into the scene,
+// sharing the cached shapes and materials.
+void make_woods(scene_data& scene, const instance_data& object,
+    const int tree_num, bool segments = false);
+
+// Forest of instanced tree variants. For each species, `variants` trees are
+// grown once at the origin with different seeds and kept as prototypes.
+// Trees are placed at `num` random points of an object, choosing a random
+// variant, aligned to the object normal, with a random rotation around it
+// and a random scale in `scale`, so that more trees only add instance
+// frames. If no species are given, the trees of make_woods() are used.
+// Nothing is added unless `num` and `variants` are positive.
+struct forest_params {
+  int                 num      = 1000;
+  int                 variants = 8;
+  vec2f               scale    = {0.8f, 1.2f};
+  uint64_t            seed     = 7;
+  vector<tree_params> species  = {};
+};
+
+void make_forest(scene_data& scene, const instance_data& object,
+    const forest_params& params);
 void generate_tree_2(scene_data& scene, const vec3f start, const vec3f norm,
     const tree_params& params, int seed);
 }  // namespace yocto
@@ -0,0 +1,479 @@
+//
+// Implementation for Yocto/NoiseGraph
+//
+
+//
+// LICENSE:
+//
+// Copyright (c) 2016 -- 2021 Fabio Pellacini
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+// -----------------------------------------------------------------------------
+// INCLUDES
+// -----------------------------------------------------------------------------
+
+#include "yocto_noisegraph.h"
+
+#include <yocto/yocto_parallel.h>
+#include <yocto/yocto_sceneio.h>
+
+#include <algorithm>
+#include <array>
+#include <stdexcept>
+
+#include "yocto_model.h"
+
+// -----------------------------------------------------------------------------
+// USING DIRECTIVES
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// using directives
+using std::array;
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION OF NOISE GRAPH LOADING
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// setup json value type
+using json_value = nlohmann::ordered_json;
+
+// Number of inputs of a node type, or -1 for any number greater than zero.
+static int noise_node_arity(noise_node_type type) {
+  switch (type) {
+    case noise_node_type::warp:
+    case noise_node_type::remap:
+    case noise_node_type::clamp: return 1;
+    case noise_node_type::add:
+    case noise_node_type::mul: return -1;
+    default: return 0;
+  }
+}
+
+// Parse a node and its inputs, returning the node index. Throws on errors,
+// with the path of the node that failed.
+static int parse_noise_node(
+    const json_value& json, noise_graph& graph, const string& path) {
+  // constants can be written as numbers
+  if (json.is_number()) {
+    auto& node = graph.nodes.emplace_back();
+    node.type  = noise_node_type::constant;
+    node.value = json.get<float>();
+    return (int)graph.nodes.size() - 1;
+  }
+  if (!json.is_object()) throw std::invalid_argument{path};
+
+  // parse json value
+  auto get_opt = [](const json_value& json, const string& key, auto& value) {
+    value = json.value(key, value);
+  };
+  auto get_ov2 = [](const json_value& json, const string& key, vec2f& value) {
+    auto valuea = json.value(key, array<float, 2>{value.x, value.y});
+    value       = {valuea[0], valuea[1]};
+  };
+
+  // node
+  auto node      = noise_node{};
+  auto type_name = json.value("type", string{"constant"});
+  auto type_it   = std::find(
+      noise_node_names.begin(), noise_node_names.end(), type_name);
+  if (type_it == noise_node_names.end())
+    throw std::invalid_argument{path + "/type"};
+  node.type = (noise_node_type)(type_it - noise_node_names.begin());
+  get_opt(json, "value", node.value);
+  get_opt(json, "scale", node.scale);
+  get_opt(json, "octaves", node.octaves);
+  get_opt(json, "u", node.u);
+  get_opt(json, "v", node.v);
+  get_opt(json, "strength", node.strength);
+  get_ov2(json, "range", node.range);
+  get_ov2(json, "target", node.target);
+  if (node.type == noise_node_type::remap && node.range.x == node.range.y)
+    throw std::invalid_argument{path + "/range"};
+
+  // inputs
+  if (json.contains("inputs")) {
+    auto& inputs = json.at("inputs");
+    if (!inputs.is_array()) throw std::invalid_argument{path + "/inputs"};
+    for (auto idx = 0; idx < (int)inputs.size(); idx++) {
+      node.inputs.push_back(parse_noise_node(
+          inputs[idx], graph, path + "/inputs/" + std::to_string(idx)));
+    }
+  }
+  auto arity = noise_node_arity(node.type);
+  if ((arity >= 0 && (int)node.inputs.size() != arity) ||
+      (arity < 0 && node.inputs.empty()))
+    throw std::invalid_argument{path + "/inputs"};
+
+  graph.nodes.push_back(node);
+  return (int)graph.nodes.size() - 1;
+}
+
+// Parse a noise graph from JSON text.
+bool parse_noise_graph(const string& text, noise_graph& graph, string& error) {
+  graph = {};
+  try {
+    auto json  = json_value::parse(text);
+    graph.root = parse_noise_node(json, graph, "graph");
+    return true;
+  } catch (const std::invalid_argument& exception) {
+    error = string{"parse error at "} + exception.what();
+    return false;
+  } catch (...) {
+    error = "parse error";
+    return false;
+  }
+}
+
+// Load a noise graph from a JSON file.
+bool load_noise_graph(
+    const string& filename, noise_graph& graph, string& error) {
+  auto text = string{};
+  if (!load_text(filename, text, error)) return false;
+  if (!parse_noise_graph(text, graph, error)) {
+    error = filename + ": " + error;
+    return false;
+  }
+  return true;
+}
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION OF NOISE GRAPH COMPILATION
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Applies the transform held by an operation to a value.
+static float apply_transform(const noise_op& op, float value) {
+  return clamp(value * op.mul + op.add, op.bounds.x, op.bounds.y);
+}
+
+// Composes an affine transform after the transform of an operation.
+// Since a * clamp(x, lo, hi) + b = clamp(a * x + b, a * lo + b, a * hi + b)
+// for a >= 0, with the bounds swapped for a < 0, the result is still an
+// affine transform followed by a clamp.
+static void fold_affine(noise_op& op, float mul, float add) {
+  if (op.type == noise_node_type::constant) {
+    op.value = op.value * mul + add;
+    return;
+  }
+  op.mul = op.mul * mul;
+  op.add = op.add * mul + add;
+  if (op.bounds != vec2f{-flt_max, flt_max}) {
+    auto lo   = op.bounds.x * mul + add;
+    auto hi   = op.bounds.y * mul + add;
+    op.bounds = mul >= 0 ? vec2f{lo, hi} : vec2f{hi, lo};
+  }
+}
+
+// Composes a clamp after the transform of an operation.
+static void fold_clamp(noise_op& op, const vec2f& bounds) {
+  if (op.type == noise_node_type::constant) {
+    op.value = clamp(op.value, bounds.x, bounds.y);
+    return;
+  }
+  op.bounds = {clamp(op.bounds.x, bounds.x, bounds.y),
+      clamp(op.bounds.y, bounds.x, bounds.y)};
+}
+
+// Compiles a node, returning the index of its operation.
+static int compile_noise_node(
+    const noise_graph& graph, int node_id, noise_program& program) {
+  auto& node = graph.nodes.at(node_id);
+
+  // inputs
+  auto inputs = vector<int>{};
+  for (auto input : node.inputs)
+    inputs.push_back(compile_noise_node(graph, input, program));
+  auto is_constant = [&program](int op) {
+    return program.ops[op].type == noise_node_type::constant;
+  };
+
+  switch (node.type) {
+    case noise_node_type::remap: {
+      auto& op  = program.ops[inputs[0]];
+      auto  mul = (node.target.y - node.target.x) /
+                 (node.range.y - node.range.x);
+      fold_affine(op, mul, node.target.x - node.range.x * mul);
+      return inputs[0];
+    }
+    case noise_node_type::clamp: {
+      fold_clamp(program.ops[inputs[0]], node.range);
+      return inputs[0];
+    }
+    case noise_node_type::warp: {
+      if (is_constant(inputs[0])) return inputs[0];
+      break;
+    }
+    case noise_node_type::add:
+    case noise_node_type::mul: {
+      // separate constant and varying inputs
+      auto is_add   = node.type == noise_node_type::add;
+      auto constant = is_add ? 0.0f : 1.0f;
+      auto varying  = vector<int>{};
+      for (auto input : inputs) {
+        if (is_constant(input)) {
+          auto value = program.ops[input].value;
+          constant   = is_add ? constant + value : constant * value;
+        } else {
+          varying.push_back(input);
+        }
+      }
+      if (varying.empty()) {
+        auto& op = program.ops.emplace_back();
+        op.type  = noise_node_type::constant;
+        op.value = constant;
+        return (int)program.ops.size() - 1;
+      }
+      // a single varying input takes the constant in its transform
+      auto op_id = varying.front();
+      if (varying.size() > 1) {
+        auto& op  = program.ops.emplace_back();
+        op.type   = node.type;
+        op.inputs = varying;
+        op_id     = (int)program.ops.size() - 1;
+      }
+      if (is_add && constant != 0) fold_affine(program.ops[op_id], 1, constant);
+      if (!is_add && constant != 1)
+        fold_affine(program.ops[op_id], constant, 0);
+      return op_id;
+    }
+    default: break;
+  }
+
+  auto& op    = program.ops.emplace_back();
+  op.type     = node.type;
+  op.value    = node.value;
+  op.scale    = node.scale;
+  op.octaves  = node.octaves;
+  op.u        = node.u;
+  op.v        = node.v;
+  op.strength = node.strength;
+  op.inputs   = inputs;
+  return (int)program.ops.size() - 1;
+}
+
+// Number of operations on the longest path from an operation to a leaf.
+static int noise_op_depth(const noise_program& program, int op_id) {
+  auto depth = 0;
+  for (auto input : program.ops[op_id].inputs)
+    depth = max(depth, noise_op_depth(program, input));
+  return depth + 1;
+}
+
+// Compiles a noise graph for evaluation.
+noise_program compile_noise_graph(const noise_graph& graph) {
+  auto program = noise_program{};
+  if (graph.root < 0) return program;
+  program.root  = compile_noise_node(graph, graph.root, program);
+  program.depth = noise_op_depth(program, program.root);
+  return program;
+}
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION OF NOISE GRAPH EVALUATION
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Number of positions evaluated together. Intermediate values of a block
+// stay in cache while all the terms are computed.
+const int noise_block_size = 1024;
+
+// Intermediate values of the operations at one level of the graph. Each
+// thread keeps one per level on the heap, since deep graphs would otherwise
+// exhaust the stack of the worker threads.
+struct noise_scratch {
+  vector<float>             results = vector<float>(noise_block_size);
+  vector<float>             factors = vector<float>(noise_block_size);
+  vector<vec3f>             warped  = vector<vec3f>(noise_block_size);
+  vector<vec3f>             offsets = vector<vec3f>(noise_block_size);
+  vector<float>             fields  = vector<float>(noise_block_size * 3);
+  vector<cell_noise_sample> samples = vector<cell_noise_sample>(
+      noise_block_size);
+};
+
+// Stores or accumulates the transformed values of an operation.
+template <bool Accumulate>
+static void store_values(
+    float* values, const noise_op& op, const float* results, int num) {
+  for (auto idx = 0; idx < num; idx++) {
+    if constexpr (Accumulate) {
+      values[idx] += apply_transform(op, results[idx]);
+    } else {
+      values[idx] = apply_transform(op, results[idx]);
+    }
+  }
+}
+
+// Evaluates a noise operation, specialized on its type.
+template <noise_node_type Type, bool Accumulate>
+static void eval_noise_kernel(float* values, const noise_op& op,
+    const vec3f* positions, int num, noise_scratch* scratch) {
+  auto& results = scratch->results;
+  if constexpr (Type == noise_node_type::perlin) {
+    noise(results.data(), positions, num, op.scale);
+  } else if constexpr (Type == noise_node_type::fbm) {
+    fbm(results.data(), positions, num, op.scale, op.octaves);
+  } else if constexpr (Type == noise_node_type::ridge) {
+    ridge(results.data(), positions, num, op.scale, op.octaves);
+  } else if constexpr (Type == noise_node_type::turbulence) {
+    turbulence(results.data(), positions, num, op.scale, op.octaves);
+  } else if constexpr (Type == noise_node_type::voronoise) {
+    for (auto idx = 0; idx < num; idx++)
+      results[idx] = fast_voronoise(positions[idx] * op.scale, op.u, op.v);
+  } else if constexpr (Type == noise_node_type::smooth_voronoi) {
+    for (auto idx = 0; idx < num; idx++)
+      results[idx] = smoothVoronoi(positions[idx] * op.scale);
+  } else if constexpr (Type == noise_node_type::cell_border) {
+    auto& samples = scratch->samples;
+    cell_noise(samples.data(), positions, num, op.scale);
+    for (auto idx = 0; idx < num; idx++) results[idx] = samples[idx].border;
+  }
+  store_values<Accumulate>(values, op, results.data(), num);
+}
+
+// Interpreter for the operations that combine other operations.
+template <bool Accumulate>
+static void eval_noise_op(float* values, const noise_program& program,
+    int op_id, const vec3f* positions, int num, noise_scratch* scratch);
+
+template <bool Accumulate>
+static void eval_noise_combine(float* values, const noise_program& program,
+    const noise_op& op, const vec3f* positions, int num,
+    noise_scratch* scratch) {
+  // inputs use the scratch of the next level
+  auto& results = scratch->results;
+  switch (op.type) {
+    case noise_node_type::constant: {
+      for (auto idx = 0; idx < num; idx++) results[idx] = op.value;
+    } break;
+    case noise_node_type::add: {
+      // inputs accumulate directly into the results
+      eval_noise_op<false>(
+          results.data(), program, op.inputs[0], positions, num, scratch + 1);
+      for (auto input = 1; input < (int)op.inputs.size(); input++)
+        eval_noise_op<true>(results.data(), program, op.inputs[input],
+            positions, num, scratch + 1);
+    } break;
+    case noise_node_type::mul: {
+      auto& factors = scratch->factors;
+      eval_noise_op<false>(
+          results.data(), program, op.inputs[0], positions, num, scratch + 1);
+      for (auto input = 1; input < (int)op.inputs.size(); input++) {
+        eval_noise_op<false>(factors.data(), program, op.inputs[input],
+            positions, num, scratch + 1);
+        for (auto idx = 0; idx < num; idx++) results[idx] *= factors[idx];
+      }
+    } break;
+    case noise_node_type::warp: {
+      // displacement field as in fbm22
+      auto& warped  = scratch->warped;
+      auto& offsets = scratch->offsets;
+      auto  fields  = array<float*, 3>{scratch->fields.data(),
+          scratch->fields.data() + noise_block_size,
+          scratch->fields.data() + noise_block_size * 2};
+      auto  shifts  = array<float, 3>{0, 2.231f, 4.12243f};
+      for (auto axis = 0; axis < 3; axis++) {
+        for (auto idx = 0; idx < num; idx++)
+          offsets[idx] = positions[idx] * op.scale + shifts[axis];
+        fbm(fields[axis], offsets.data(), num, 1, op.octaves);
+      }
+      for (auto idx = 0; idx < num; idx++) {
+        auto field  = vec3f{fields[0][idx], fields[1][idx], fields[2][idx]};
+        warped[idx] = positions[idx] + field * op.strength;
+      }
+      eval_noise_op<false>(results.data(), program, op.inputs[0],
+          warped.data(), num, scratch + 1);
+    } break;
+    default: break;
+  }
+  store_values<Accumulate>(values, op, results.data(), num);
+}
+
+template <bool Accumulate>
+static void eval_noise_op(float* values, const noise_program& program,
+    int op_id, const vec3f* positions, int num, noise_scratch* scratch) {
+  auto& op = program.ops[op_id];
+  switch (op.type) {
+    case noise_node_type::perlin:
+      return eval_noise_kernel<noise_node_type::perlin, Accumulate>(
+          values, op, positions, num, scratch);
+    case noise_node_type::fbm:
+      return eval_noise_kernel<noise_node_type::fbm, Accumulate>(
+          values, op, positions, num, scratch);
+    case noise_node_type::ridge:
+      return eval_noise_kernel<noise_node_type::ridge, Accumulate>(
+          values, op, positions, num, scratch);
+    case noise_node_type::turbulence:
+      return eval_noise_kernel<noise_node_type::turbulence, Accumulate>(
+          values, op, positions, num, scratch);
+    case noise_node_type::voronoise:
+      return eval_noise_kernel<noise_node_type::voronoise, Accumulate>(
+          values, op, positions, num, scratch);
+    case noise_node_type::smooth_voronoi:
+      return eval_noise_kernel<noise_node_type::smooth_voronoi, Accumulate>(
+          values, op, positions, num, scratch);
+    case noise_node_type::cell_border:
+      return eval_noise_kernel<noise_node_type::cell_border, Accumulate>(
+          values, op, positions, num, scratch);
+    default:
+      return eval_noise_combine<Accumulate>(
+          values, program, op, positions, num, scratch);
+  }
+}
+
+// Evaluates a compiled noise graph at `num` positions.
+void eval_noise_program(float* values, const noise_program& program,
+    const vec3f* positions, int num) {
+  if (program.root < 0) {
+    for (auto idx = 0; idx < num; idx++) values[idx] = 0;
+    return;
+  }
+  thread_local static auto scratch = vector<noise_scratch>{};
+  if ((int)scratch.size() < program.depth) scratch.resize(program.depth);
+  for (auto start = 0; start < num; start += noise_block_size) {
+    eval_noise_op<false>(values + start, program, program.root,
+        positions + start, min(noise_block_size, num - start),
+        scratch.data());
+  }
+}
+
+// Evaluates a noise graph at all positions in parallel.
+void eval_noise_graph(vector<float>& values, const noise_graph& graph,
+    const vector<vec3f>& positions) {
+  auto program    = compile_noise_graph(graph);
+  auto num        = (int)positions.size();
+  auto num_blocks = (num + noise_block_size - 1) / noise_block_size;
+  values.resize(positions.size());
+  parallel_for(num_blocks, [&](int block) {
+    auto start = block * noise_block_size;
+    eval_noise_program(values.data() + start, program,
+        positions.data() + start, min(noise_block_size, num - start));
+  });
+}
+
+}  // namespace yocto
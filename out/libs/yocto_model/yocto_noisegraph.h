@@ -0,0 +1,151 @@
+//
+// # Yocto/NoiseGraph: Composable noise expressions
+//
+// Yocto/NoiseGraph describes procedural height fields as expression trees of
+// noise functions, domain warps and arithmetic, loaded from JSON.
+// Graphs are compiled before evaluation: constant arithmetic is folded into
+// the result of the noise nodes, and noise nodes are evaluated by kernels
+// specialized at compile time on the noise type, that also accumulate sums
+// in place. The remaining nodes are interpreted. Positions are evaluated in
+// blocks, so all the terms of a graph run while a block is in cache.
+// Yocto/NoiseGraph is implemented in `yocto_noisegraph.h` and
+// `yocto_noisegraph.cpp`.
+//
+
+//
+// LICENSE:
+//
+// Copyright (c) 2016 -- 2021 Fabio Pellacini
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+//
+
+#ifndef _YOCTO_NOISEGRAPH_H_
+#define _YOCTO_NOISEGRAPH_H_
+
+// -----------------------------------------------------------------------------
+// INCLUDES
+// -----------------------------------------------------------------------------
+
+#include <yocto/yocto_math.h>
+
+#include <string>
+#include <vector>
+
+// -----------------------------------------------------------------------------
+// USING DIRECTIVES
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// using directives
+using std::string;
+using std::vector;
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// NOISE GRAPH
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Noise node types
+enum struct noise_node_type {
+  // clang-format off
+  constant, perlin, fbm, ridge, turbulence, voronoise, smooth_voronoi,
+  cell_border, warp, add, mul, remap, clamp
+  // clang-format on
+};
+
+// Enum labels
+inline const auto noise_node_names = std::vector<std::string>{"constant",
+    "perlin", "fbm", "ridge", "turbulence", "voronoise", "smooth_voronoi",
+    "cell_border", "warp", "add", "mul", "remap", "clamp"};
+
+// Noise graph node. Noise nodes are evaluated at positions multiplied by
+// `scale`. Warp nodes evaluate their input at positions displaced by
+// `strength` times a fbm vector field of frequency `scale`, as in `fbm22()`.
+// Add and mul combine any number of inputs, remap maps its input from a
+// non-empty `range` to `target` and clamp clamps its input to `range`.
+struct noise_node {
+  noise_node_type type     = noise_node_type::constant;
+  float           value    = 0;
+  float           scale    = 1;
+  int             octaves  = 8;
+  float           u        = 1;
+  float           v        = 1;
+  float           strength = 1;
+  vec2f           range    = {0, 1};
+  vec2f           target   = {0, 1};
+  vector<int>     inputs   = {};
+};
+
+// Noise graph, stored as a list of nodes with the output in `root`.
+struct noise_graph {
+  vector<noise_node> nodes = {};
+  int                root  = -1;
+};
+
+// Load a noise graph from JSON. Nodes are objects with a "type", the node
+// parameters and an "inputs" array of nodes or numbers, e.g.
+//   {"type": "add", "inputs": [{"type": "voronoise", "scale": 50},
+//     {"type": "mul", "inputs": [{"type": "ridge", "scale": 50}, 0.5]}]}
+bool load_noise_graph(
+    const string& filename, noise_graph& graph, string& error);
+bool parse_noise_graph(const string& text, noise_graph& graph, string& error);
+
+// Compiled noise operation. The result of each operation is transformed by
+// `clamp(value * mul + add, bounds.x, bounds.y)`, that holds the constant
+// arithmetic folded from its parent nodes.
+struct noise_op {
+  noise_node_type type     = noise_node_type::constant;
+  float           value    = 0;
+  float           scale    = 1;
+  int             octaves  = 8;
+  float           u        = 1;
+  float           v        = 1;
+  float           strength = 1;
+  float           mul      = 1;
+  float           add      = 0;
+  vec2f           bounds   = {-flt_max, flt_max};
+  vector<int>     inputs   = {};
+};
+
+// Compiled noise graph, with the output in `root`. The `depth` is the
+// number of operations on the longest path from the root to a leaf.
+struct noise_program {
+  vector<noise_op> ops   = {};
+  int              root  = -1;
+  int              depth = 0;
+};
+
+// Compiles a noise graph for evaluation.
+noise_program compile_noise_graph(const noise_graph& graph);
+
+// Evaluates a compiled noise graph at `num` positions.
+void eval_noise_program(float* values, const noise_program& program,
+    const vec3f* positions, int num);
+
+// Evaluates a noise graph at all positions in parallel.
+void eval_noise_graph(vector<float>& values, const noise_graph& graph,
+    const vector<vec3f>& positions);
+
+}  // namespace yocto
+
+#endif
@@ -1,3 +1,4 @@
+# ./bin/ymodel --voronoise_check
 # ./bin/ymodel --scene tests/01_terrain/terrain.json --output outs/01_terrain/terrain.json --terrain object
 # ./bin/ymodel --scene tests/02_displacement/displacement.json --output outs/02_displacement/displacement.json --displacement object --voronoise_u 0 --voronoise_v 0
 # ./bin/ymodel --scene tests/03_hair1/hair1.json --output outs/03_hair1/hair1.json --hairbase object --hair hair --dense_hair